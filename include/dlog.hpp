@@ -4,12 +4,80 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <sstream>
+#include <cstring>
+#include <array>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <type_traits>
+#include <tuple>
+#include <thread>
 #include <future>
-#include <queue>
 #include <mutex>
+#include <condition_variable>
 #include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <chrono>
 #include <unordered_map>
+#include <limits>
+#include <ctime>
+#include <cmath>
+#include <charconv>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if __has_include(<sys/mman.h>)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#define DLOG_HAS_MMAP 1
+#endif
+
+/// Number of records each thread can hand over
+/// to the printer in async mode before it has to
+/// wait for the printer to catch up. Must be a power of two.
+#ifndef DLOG_RING_CAPACITY
+#define DLOG_RING_CAPACITY 1024
+#endif
+
+/// Messages logged through DLOG() with a log level
+/// below this threshold are removed at compile time.
+/// Messages with log level 0 are never removed.
+#ifndef DLOG_MIN_LEVEL
+#define DLOG_MIN_LEVEL 0
+#endif
+
+/// Size of the inline buffer in each dlog object.
+/// Longer output is moved to the heap.
+#ifndef DLOG_BUFFER_SIZE
+#define DLOG_BUFFER_SIZE 256
+#endif
+
+/// Number of streams which can be written to
+/// without sharing a mutex with other streams.
+/// Must be a power of two.
+#ifndef DLOG_MAX_STREAMS
+#define DLOG_MAX_STREAMS 64
+#endif
+
+/// Set to 0 to remove the counters
+/// behind dlog::stats() from the write path.
+#ifndef DLOG_STATS
+#define DLOG_STATS 1
+#endif
 
 namespace Async
 {
@@ -18,6 +86,20 @@ namespace Async
 
 	using glock = std::lock_guard<std::mutex>;
 
+	using ulock = std::unique_lock<std::mutex>;
+
+	/// Assumed size of a cache line.
+	inline constexpr std::size_t cache_line{64};
+
+	/// Indicates whether T is a shared pointer to an output stream.
+	template<typename T>
+	inline constexpr bool is_shared_stream{false};
+
+	template<typename T>
+	inline constexpr bool is_shared_stream<std::shared_ptr<T>>{std::is_base_of_v<std::ostream, T>};
+
+	class Layout;
+
 	/// Set of strings affixed to the input
 	/// at various positions.
 	struct AffixSet
@@ -29,252 +111,5085 @@ namespace Async
 			inline static std::string prefix{""};
 			inline static std::string infix{" "};
 			inline static std::string suffix{"\n"};
+			inline static std::shared_ptr<const Layout> layout{nullptr};
 		};
 
 		uint log_level{Default::log_level};
 		std::string prefix{Default::prefix};
 		std::string infix{Default::infix};
 		std::string suffix{Default::suffix};
+
+		/// Rendered before the prefix when the record is written.
+		std::shared_ptr<const Layout> layout{Default::layout};
 	};
 
-	/// @class The dlog class.
-	/// @details
-	/// dlog ("debug log") is a tiny header-only library
-	/// for printing output from multiple threads to
-	/// arbitrary streams without garbling the output.
-	class dlog
+	/// Wall-clock timestamps for log output.
+	/// Each thread caches the formatted date and time and only
+	/// reformats it when the second changes. Within a second,
+	/// only the sub-second digits are patched into the cached
+	/// string. The broken-down local time is derived with
+	/// gmtime_r() from a cached UTC offset, which is refreshed
+	/// with localtime_r() once a minute, so the time zone lock
+	/// is rarely taken.
+	class Timestamp
 	{
-
 	public:
 
-		/// Version string.
-		inline static const std::string version{"0.2.4"};
+		enum class Precision : uint
+		{
+			Seconds = 0,
+			Milliseconds = 3,
+			Microseconds = 6,
+			Nanoseconds = 9
+		};
 
 	private:
 
-		/// Default log level.
-		inline static uint log_level{0};
-
-		/// Master mutex for accessing the semaphores.
-		inline static std::mutex semaphore_mutex;
-
-		/// Pointers to output streams and
-		/// corresponding mutexes.
-		inline static hmap<std::ostream*, std::mutex> semaphores;
+		/// Format shared by all threads.
+		struct Settings
+		{
+			std::mutex mutex;
+			std::string format{"%F %T.%f"};
+			Precision precision{Precision::Milliseconds};
 
-		bool out{true};
+			/// Incremented whenever the format changes,
+			/// which invalidates the thread caches.
+			std::atomic<std::uint64_t> generation{0};
+		};
 
-		/// Strings appended to the input.
-		/// If not set in the constructor, these
-		/// are given the default values.
-		AffixSet afx;
+		/// Per-thread cache of the formatted time.
+		struct Cache
+		{
+			std::uint64_t generation{std::numeric_limits<std::uint64_t>::max()};
 
-		std::shared_ptr<std::ostream> ofs{nullptr};
+			/// The format split at the %f placeholder.
+			std::string head;
+			std::string tail;
+			bool fraction{false};
+			uint digits{0};
 
-		/// Stream associated with this log.
-		std::ostream& stream{std::cout};
+			std::int64_t second{std::numeric_limits<std::int64_t>::min()};
 
-		/// Buffer for storing the output.
-		std::stringstream buffer;
+			/// Formatted time with room for the sub-second digits.
+			std::string text;
+			std::size_t digits_at{0};
 
-	public:
+			/// Local time zone as of the last call to localtime_r().
+			std::int64_t zone_until{std::numeric_limits<std::int64_t>::min()};
+			long gmtoff{0};
+			int isdst{0};
+			const char* zone{nullptr};
+		};
 
-		template<typename Arg, typename ... Args>
-		dlog(std::ostream& _stream, AffixSet _afx, Arg&& _arg, Args&& ... _args)
-			:
-			  out(_afx.log_level == 0 || _afx.log_level >= log_level),
-			  afx(_afx),
-			  stream(_stream)
+		static Settings& settings()
 		{
-			init(std::forward<Args>(_args)...);
+			static Settings s;
+			return s;
 		}
 
-		template<typename ... Args>
-		dlog(std::shared_ptr<std::ofstream> _stream, Args&& ... _args)
-			:
-			  dlog(static_cast<std::ostream&>(*_stream), std::forward<Args>(_args)...)
+		static Cache& cache()
 		{
-			ofs = _stream;
+			thread_local Cache c;
+			return c;
 		}
 
-		template<typename ... Args>
-		dlog(std::ostream& _stream, Args&& ... _args)
-			:
-			  stream(_stream)
+	public:
+
+		/// Set the strftime() format used for timestamps.
+		/// The placeholder %f is replaced by the sub-second
+		/// digits at the given precision.
+		static void set_format(const std::string& _format, const Precision _precision = Precision::Milliseconds)
 		{
-			init(std::forward<Args>(_args)...);
+			Settings& s(settings());
+			glock lk(s.mutex);
+			s.format = _format;
+			s.precision = _precision;
+			s.generation.fetch_add(1, std::memory_order_release);
 		}
 
-		template<typename ... Args>
-		dlog(AffixSet _afx, Args&& ... _args)
-			:
-			  out(_afx.log_level == 0 || _afx.log_level >= log_level),
-			  afx(_afx)
+		/// Nanoseconds since the epoch.
+		/// Uses the vDSO-backed clock_gettime() where available.
+		static std::int64_t clock()
 		{
-			init(std::forward<Args>(_args)...);
+#ifdef CLOCK_REALTIME
+			timespec ts;
+			::clock_gettime(CLOCK_REALTIME, &ts);
+			return static_cast<std::int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+#endif
 		}
 
-		template<typename ... Args>
-		dlog(Args&& ... _args)
+		/// The current time, formatted. The view stays
+		/// valid until the next call on the same thread.
+		static std::string_view now()
 		{
-			init(std::forward<Args>(_args)...);
+			return format(clock());
 		}
 
-		~dlog()
+		/// A time given in nanoseconds since the epoch, formatted.
+		/// The view stays valid until the next call on the same thread.
+		static std::string_view format(const std::int64_t _ns)
 		{
-			if (out)
+			Cache& c(cache());
+
+			const std::uint64_t generation(settings().generation.load(std::memory_order_acquire));
+			if (c.generation != generation)
 			{
-				buffer << afx.suffix;
-				flush(stream, buffer.str());
+				Settings& s(settings());
+				glock lk(s.mutex);
+				const std::size_t pos(s.format.find("%f"));
+				c.fraction = pos != std::string::npos;
+				c.head = s.format.substr(0, pos);
+				c.tail = c.fraction ? s.format.substr(pos + 2) : std::string();
+				c.digits = static_cast<uint>(s.precision);
+				c.second = std::numeric_limits<std::int64_t>::min();
+				c.generation = s.generation.load(std::memory_order_relaxed);
 			}
-		}
 
-		template<typename T>
-		friend dlog& operator << (dlog& _dlog, T&& _t)
-		{
-			_dlog.gobble(std::forward<T>(_t));
-			return _dlog;
-		}
+			std::int64_t second(_ns / 1000000000);
+			std::int64_t sub(_ns % 1000000000);
+			if (sub < 0)
+			{
+				--second;
+				sub += 1000000000;
+			}
 
-		friend dlog& operator << (dlog& _dlog, std::ostream& (*_fp)(std::ostream&))
-		{
-			if (_dlog.out)
+			if (second != c.second)
 			{
-				_dlog.buffer << _fp;
+				render(c, second);
 			}
-			return _dlog;
+
+			if (c.fraction)
+			{
+				/// Patch in the sub-second digits.
+				std::int64_t value(sub);
+				for (uint i = c.digits; i < 9; ++i)
+				{
+					value /= 10;
+				}
+				for (uint i = c.digits; i > 0; --i)
+				{
+					c.text[c.digits_at + i - 1] = static_cast<char>('0' + value % 10);
+					value /= 10;
+				}
+			}
+			return c.text;
 		}
 
-		///=====================================
-		/// Other convenience functions.
-		///=====================================
+	private:
 
-		template<typename T>
-		dlog& add(T&& _t)
+		static void render(Cache& _cache, const std::int64_t _second)
 		{
-			if (out)
+			if (_second >= _cache.zone_until || _second < _cache.zone_until - 60)
 			{
-				buffer << std::forward<T>(_t);
+				const std::time_t t(static_cast<std::time_t>(_second));
+				std::tm local;
+				::localtime_r(&t, &local);
+				_cache.gmtoff = local.tm_gmtoff;
+				_cache.isdst = local.tm_isdst;
+				_cache.zone = local.tm_zone;
+				_cache.zone_until = _second - _second % 60 + 60;
 			}
-			return *this;
-		}
 
-		template<typename T>
-		dlog& operator + (T&& _t)
-		{
-			add(std::forward<T>(_t));
-			return *this;
-		}
+			const std::time_t shifted(static_cast<std::time_t>(_second + _cache.gmtoff));
+			std::tm tm;
+			::gmtime_r(&shifted, &tm);
+			tm.tm_gmtoff = _cache.gmtoff;
+			tm.tm_isdst = _cache.isdst;
+			tm.tm_zone = _cache.zone;
 
-		template<typename T>
-		dlog& format(T&& _t, const uint _width)
-		{
-			if (out)
+			std::array<char, 256> buf;
+			_cache.text.assign(buf.data(), std::strftime(buf.data(), buf.size(), _cache.head.c_str(), &tm));
+			if (_cache.fraction)
 			{
-				buffer << std::setw(_width) << std::forward<T>(_t);
+				_cache.digits_at = _cache.text.size();
+				_cache.text.append(_cache.digits, '0');
+				_cache.text.append(buf.data(), std::strftime(buf.data(), buf.size(), _cache.tail.c_str(), &tm));
 			}
-			return *this;
+			_cache.second = _second;
 		}
+	};
 
-		///=====================================
-		/// Output formatting
-		///=====================================
+	/// Prefix pattern with placeholders which are
+	/// filled in when the record is written:
+	///
+	/// %l  log level
+	/// %L  log level name (the level if it has no name)
+	/// %T  timestamp (see Timestamp)
+	/// %t  thread ID
+	/// %%  a literal %
+	///
+	/// The pattern is parsed once into a list of steps,
+	/// so rendering it involves no parsing or concatenation.
+	/// In async mode, layouts are rendered by the printer.
+	class Layout
+	{
+	public:
 
-		inline dlog& left()
+		/// Values captured when the message is logged.
+		struct Fields
 		{
-			if (out)
+			uint log_level{0};
+			std::int64_t time{0};
+			std::thread::id thread;
+		};
+
+	private:
+
+		enum class Op : std::uint8_t
+		{
+			Text,
+			Level,
+			Name,
+			Time,
+			Thread
+		};
+
+		struct Step
+		{
+			Op op;
+			std::string text;
+		};
+
+		std::vector<Step> steps;
+
+		std::vector<std::string> names;
+
+	public:
+
+		explicit Layout(const std::string_view _pattern, std::vector<std::string> _names = {})
+			:
+			  names(std::move(_names))
+		{
+			std::string text;
+			for (std::size_t i = 0; i < _pattern.size(); ++i)
 			{
-				buffer << std::left;
+				if (_pattern[i] != '%' || i + 1 == _pattern.size())
+				{
+					text.push_back(_pattern[i]);
+					continue;
+				}
+
+				Op op;
+				switch (_pattern[++i])
+				{
+				case 'l': op = Op::Level; break;
+				case 'L': op = Op::Name; break;
+				case 'T': op = Op::Time; break;
+				case 't': op = Op::Thread; break;
+				case '%':
+					text.push_back('%');
+					continue;
+				default:
+					/// Unknown placeholders are kept as they are.
+					text.push_back('%');
+					text.push_back(_pattern[i]);
+					continue;
+				}
+
+				if (!text.empty())
+				{
+					steps.push_back({Op::Text, std::move(text)});
+					text.clear();
+				}
+				steps.push_back({op, {}});
 			}
-			return *this;
-		}
 
-		inline dlog& internal()
-		{
-			if (out)
+			if (!text.empty())
 			{
-				buffer << std::internal;
+				steps.push_back({Op::Text, std::move(text)});
 			}
-			return *this;
 		}
 
-		inline dlog& right()
+		void render(std::ostream& _out, const Fields& _fields) const
 		{
-			if (out)
+			for (const Step& step : steps)
 			{
-				buffer << std::right;
+				switch (step.op)
+				{
+				case Op::Text:
+					_out.write(step.text.data(), static_cast<std::streamsize>(step.text.size()));
+					break;
+
+				case Op::Name:
+					if (_fields.log_level < names.size())
+					{
+						_out << names[_fields.log_level];
+						break;
+					}
+					[[fallthrough]];
+
+				case Op::Level:
+					_out << _fields.log_level;
+					break;
+
+				case Op::Time:
+					_out << Timestamp::format(_fields.time);
+					break;
+
+				case Op::Thread:
+					_out << _fields.thread;
+					break;
+				}
 			}
-			return *this;
 		}
+	};
 
-		inline dlog& setfill(const char _ch = ' ')
+	///=====================================
+	/// Floating-point numbers
+	///=====================================
+
+	/// Floating-point value printed with a given number of
+	/// digits after the decimal point, in fixed or in
+	/// scientific notation (see fixed() and scientific()).
+	template<typename T>
+	struct Rounded
+	{
+		T value;
+
+		std::chars_format notation;
+
+		int precision;
+	};
+
+	template<typename T>
+	inline constexpr bool is_rounded{false};
+
+	template<typename T>
+	inline constexpr bool is_rounded<Rounded<T>>{true};
+
+	template<typename T, typename = std::enable_if_t<std::is_floating_point_v<T>>>
+	Rounded<T> fixed(const T _value, const int _precision)
+	{
+		return {_value, std::chars_format::fixed, _precision};
+	}
+
+	template<typename T, typename = std::enable_if_t<std::is_floating_point_v<T>>>
+	Rounded<T> scientific(const T _value, const int _precision)
+	{
+		return {_value, std::chars_format::scientific, _precision};
+	}
+
+	template<typename T>
+	std::ostream& operator << (std::ostream& _os, const Rounded<T>& _r)
+	{
+		const std::ios_base::fmtflags flags(_os.flags());
+		const std::streamsize precision(_os.precision());
+		_os.setf(_r.notation == std::chars_format::fixed ? std::ios_base::fixed : std::ios_base::scientific, std::ios_base::floatfield);
+		_os.precision(_r.precision);
+		_os << _r.value;
+		_os.flags(flags);
+		_os.precision(precision);
+		return _os;
+	}
+
+	/// Write the text of a floating-point number to _first.
+	/// Without a notation, this is the shortest text which reads
+	/// back as the same value. Returns nullptr if the text does
+	/// not fit or the standard library cannot format it.
+	template<typename T>
+	char* to_text(char* _first, char* _last, const T _value, const std::chars_format _notation = std::chars_format{}, const int _precision = 0)
+	{
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+		const std::to_chars_result result(_notation == std::chars_format{} ?
+										  std::to_chars(_first, _last, _value) :
+										  std::to_chars(_first, _last, _value, _notation, _precision));
+		return result.ec == std::errc() ? result.ptr : nullptr;
+#else
+		return nullptr;
+#endif
+	}
+
+	/// Write a floating-point number to a stream as the shortest
+	/// text which reads back as the same value, unless the stream
+	/// asks for a particular notation or precision or its locale
+	/// does not use '.' as the decimal point.
+	template<typename T>
+	void print_float(std::ostream& _os, const T _value)
+	{
+		constexpr std::ios_base::fmtflags custom(std::ios_base::floatfield | std::ios_base::showpos | std::ios_base::showpoint | std::ios_base::uppercase);
+		if ((_os.flags() & custom) == 0 &&
+			_os.precision() == 6 &&
+			std::use_facet<std::numpunct<char>>(_os.getloc()).decimal_point() == '.')
 		{
-			if (out)
+			std::array<char, 64> text;
+			if (const char* end = to_text(text.data(), text.data() + text.size(), _value))
 			{
-				buffer << std::setfill(_ch);
+				_os << std::string_view(text.data(), static_cast<std::size_t>(end - text.data()));
+				return;
 			}
-			return *this;
 		}
+		_os << _value;
+	}
 
-		///=====================================
-		/// Static functions.
-		///=====================================
+	///=====================================
+	/// Structured fields
+	///=====================================
 
-		static void set_log_level(const uint _level)
+	/// Named value logged with kv(). In plain text it is
+	/// printed as key=value. Streams with a structured
+	/// encoding (see dlog::set_encoding()) print it as
+	/// a member of a JSON object or as a logfmt pair.
+	template<typename T>
+	struct Field
+	{
+		std::string_view key;
+
+		T value;
+	};
+
+	template<typename T>
+	inline constexpr bool is_field{false};
+
+	template<typename T>
+	inline constexpr bool is_field<Field<T>>{true};
+
+	/// A field holds on to lvalues by reference and
+	/// takes temporaries by value, so it must not
+	/// outlive the statement which logs it.
+	template<typename T>
+	Field<T> kv(const std::string_view _key, T&& _value)
+	{
+		return {_key, std::forward<T>(_value)};
+	}
+
+	/// Write a character which has to be escaped in a JSON string.
+	template<typename Out>
+	void escape_char(Out& _out, const char _ch)
+	{
+		switch (_ch)
 		{
-			log_level = _level;
+		case '"':
+			_out.append("\\\"", 2);
+			return;
+		case '\\':
+			_out.append("\\\\", 2);
+			return;
+		case '\n':
+			_out.append("\\n", 2);
+			return;
+		case '\r':
+			_out.append("\\r", 2);
+			return;
+		case '\t':
+			_out.append("\\t", 2);
+			return;
+		default:
+			break;
 		}
 
-	private:
+		static constexpr char hex[]{"0123456789abcdef"};
+		const unsigned char ch(static_cast<unsigned char>(_ch));
+		const char code[]{'\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xf]};
+		_out.append(code, sizeof(code));
+	}
 
-		static void spawn_printer()
-		{
-			std::thread([&]()
-			{
+	/// Write _str to _out as the body of a JSON string,
+	/// escaping quotes, backslashes and control characters.
+	/// Other bytes, including UTF-8 sequences, are copied as
+	/// they are. With SSE2 or AVX2 the input is scanned 16 or
+	/// 32 bytes at a time and copied in runs between the
+	/// characters which need escaping.
+	template<typename Out>
+	void escape_json(Out& _out, const std::string_view _str)
+	{
+		const char* pos(_str.data());
+		const char* const end(pos + _str.size());
 
-			});
-		}
+		/// Start of the characters not copied yet.
+		const char* run(pos);
 
-		template<typename ... Args>
-		void init() {}
+		const auto escape([&](const char* _at)
+		{
+			_out.append(run, static_cast<std::size_t>(_at - run));
+			escape_char(_out, *_at);
+			run = _at + 1;
+		});
 
-		template<typename Arg, typename ... Args>
-		void init(Arg&& _arg, Args&& ... _args)
+#if defined(__AVX2__)
+		const __m256i quote32(_mm256_set1_epi8('"'));
+		const __m256i backslash32(_mm256_set1_epi8('\\'));
+		const __m256i control32(_mm256_set1_epi8(0x1f));
+		for (; end - pos >= 32; pos += 32)
 		{
-			if (out)
+			const __m256i bytes(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos)));
+			const __m256i hits(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, quote32),
+																  _mm256_cmpeq_epi8(bytes, backslash32)),
+											   _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, control32), bytes)));
+			for (std::uint32_t mask = static_cast<std::uint32_t>(_mm256_movemask_epi8(hits)); mask != 0; mask &= mask - 1)
 			{
-				buffer << afx.prefix << std::forward<Arg>(_arg);
-				gobble(std::forward<Args>(_args)...);
+				escape(pos + __builtin_ctz(mask));
 			}
 		}
+#endif
 
-		template<typename ... Args>
-		void gobble(Args&& ... _args)
+#if defined(__SSE2__)
+		const __m128i quote16(_mm_set1_epi8('"'));
+		const __m128i backslash16(_mm_set1_epi8('\\'));
+		const __m128i control16(_mm_set1_epi8(0x1f));
+		for (; end - pos >= 16; pos += 16)
 		{
-			if (out)
+			const __m128i bytes(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos)));
+			const __m128i hits(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, quote16),
+														 _mm_cmpeq_epi8(bytes, backslash16)),
+											_mm_cmpeq_epi8(_mm_min_epu8(bytes, control16), bytes)));
+			for (std::uint32_t mask = static_cast<std::uint32_t>(_mm_movemask_epi8(hits)); mask != 0; mask &= mask - 1)
 			{
-				std::array<int, sizeof...(_args)> status{(buffer << afx.infix << std::forward<Args>(_args), 0) ...};
+				escape(pos + __builtin_ctz(mask));
 			}
 		}
+#endif
 
-		static void flush(std::ostream& _stream, const std::string& _content)
+		for (; pos < end; ++pos)
 		{
-			if (_content.size() > 0)
+			if (*pos == '"' || *pos == '\\' || static_cast<unsigned char>(*pos) < 0x20)
 			{
-				glock lock(semaphore_mutex);
-				std::ostream* os(std::addressof(_stream));
-				if (os)
-				{
-					glock lk(semaphores[os]);
-					*os << _content;
-				}
-				else
-				{
-					semaphores.erase(os);
-				}
+				escape(pos);
 			}
 		}
+
+		_out.append(run, static_cast<std::size_t>(end - run));
+	}
+
+	/// Write _str to _out as a logfmt value. Values which are
+	/// empty or contain spaces, '=', quotes or control characters
+	/// are quoted and escaped as JSON strings.
+	template<typename Out>
+	void escape_logfmt(Out& _out, const std::string_view _str)
+	{
+		const bool bare(!_str.empty() &&
+						std::none_of(_str.begin(), _str.end(), [](const char _ch)
+		{
+			return static_cast<unsigned char>(_ch) <= ' ' || _ch == '=' || _ch == '"' || _ch == '\\';
+		}));
+
+		if (bare)
+		{
+			_out.append(_str.data(), _str.size());
+			return;
+		}
+
+		_out.append("\"", 1);
+		escape_json(_out, _str);
+		_out.append("\"", 1);
+	}
+
+	///=====================================
+	/// Deferred formatting
+	///=====================================
+
+	/// Types of arguments which can be logged without
+	/// being formatted on the calling thread.
+	/// The values are part of the binary log format.
+	enum class Tag : std::uint8_t
+	{
+		Int = 1,	///< Signed integer, stored as 64 bits.
+		UInt,		///< Unsigned integer, stored as 64 bits.
+		Float,		///< Floating-point number, stored as a double.
+		Bool,		///< Stored as a single byte.
+		Char,		///< Stored as a single byte.
+		Literal,	///< String literal marked with DLOG_LIT, stored as a pointer.
+		String,		///< Stored by value, preceded by its length.
+		Pointer,	///< Address, stored as 64 bits.
+		Single		///< Single-precision floating-point number, stored as a float.
 	};
-}
+
+	/// String literal which dlog::defer() stores by pointer
+	/// instead of copying it. Created with DLOG_LIT, which
+	/// only accepts string literals.
+	struct Literal
+	{
+		const char* text;
+	};
+
+	inline std::ostream& operator << (std::ostream& _os, const Literal _lit)
+	{
+		return _os << _lit.text;
+	}
+
+	/// Static description of the arguments of a deferred message.
+	struct Format
+	{
+		const Tag* tags{nullptr};
+
+		std::size_t count{0};
+	};
+
+	/// One format per argument signature.
+	template<Tag ... tags>
+	struct Signature
+	{
+		static constexpr std::array<Tag, sizeof...(tags)> list{tags...};
+
+		static constexpr Format format{list.data(), list.size()};
+	};
+
+	/// Encoding and decoding of deferred messages.
+	/// A message is stored as its log level, its affixes and
+	/// the raw values of its arguments in native byte order.
+	/// Turning it into text later produces exactly the output
+	/// which dlog would have produced with the same arguments.
+	struct Codec
+	{
+		template<typename T>
+		static constexpr Tag tag()
+		{
+			using Ref = std::remove_reference_t<T>;
+			using U = std::remove_cv_t<Ref>;
+
+			if constexpr (std::is_same_v<U, bool>)
+			{
+				return Tag::Bool;
+			}
+			else if constexpr (std::is_same_v<U, char> || std::is_same_v<U, signed char> || std::is_same_v<U, unsigned char>)
+			{
+				return Tag::Char;
+			}
+			else if constexpr (std::is_integral_v<U>)
+			{
+				return std::is_signed_v<U> ? Tag::Int : Tag::UInt;
+			}
+			else if constexpr (std::is_same_v<U, float>)
+			{
+				return Tag::Single;
+			}
+			else if constexpr (std::is_floating_point_v<U>)
+			{
+				return Tag::Float;
+			}
+			else if constexpr (std::is_same_v<U, Literal>)
+			{
+				return Tag::Literal;
+			}
+			else if constexpr (std::is_convertible_v<const U&, std::string_view>)
+			{
+				return Tag::String;
+			}
+			else if constexpr (std::is_pointer_v<U>)
+			{
+				return Tag::Pointer;
+			}
+			else
+			{
+				static_assert(std::is_void_v<T>, "This type cannot be deferred; log it with dlog instead.");
+				return Tag::String;
+			}
+		}
+
+		/// Format of a message with the given arguments.
+		template<typename ... Args>
+		static constexpr const Format* format()
+		{
+			return &Signature<tag<Args>()...>::format;
+		}
+
+		template<typename T>
+		static void write(std::streambuf& _buf, const T _value)
+		{
+			_buf.sputn(reinterpret_cast<const char*>(&_value), sizeof(T));
+		}
+
+		static void write(std::streambuf& _buf, const std::string_view _str)
+		{
+			write(_buf, static_cast<std::uint32_t>(_str.size()));
+			_buf.sputn(_str.data(), static_cast<std::streamsize>(_str.size()));
+		}
+
+		/// Store the log level and the affixes.
+		static void header(std::streambuf& _buf, const AffixSet& _afx)
+		{
+			write(_buf, static_cast<std::uint32_t>(_afx.log_level));
+			write(_buf, std::string_view(_afx.prefix));
+			write(_buf, std::string_view(_afx.infix));
+			write(_buf, std::string_view(_afx.suffix));
+		}
+
+		/// Store a single argument.
+		template<typename T>
+		static void put(std::streambuf& _buf, T&& _arg)
+		{
+			constexpr Tag t(tag<T>());
+			if constexpr (t == Tag::Int)
+			{
+				write(_buf, static_cast<std::int64_t>(_arg));
+			}
+			else if constexpr (t == Tag::UInt)
+			{
+				write(_buf, static_cast<std::uint64_t>(_arg));
+			}
+			else if constexpr (t == Tag::Float)
+			{
+				write(_buf, static_cast<double>(_arg));
+			}
+			else if constexpr (t == Tag::Single)
+			{
+				write(_buf, static_cast<float>(_arg));
+			}
+			else if constexpr (t == Tag::Bool || t == Tag::Char)
+			{
+				write(_buf, static_cast<char>(_arg));
+			}
+			else if constexpr (t == Tag::Literal)
+			{
+				write(_buf, reinterpret_cast<std::uint64_t>(_arg.text));
+			}
+			else if constexpr (t == Tag::String)
+			{
+				write(_buf, std::string_view(_arg));
+			}
+			else
+			{
+				write(_buf, reinterpret_cast<std::uint64_t>(static_cast<const void*>(_arg)));
+			}
+		}
+
+		/// Sequential reader over an encoded message.
+		class Reader
+		{
+			std::string_view data;
+
+		public:
+
+			explicit Reader(const std::string_view _data)
+				:
+				  data(_data)
+			{}
+
+			template<typename T>
+			T get()
+			{
+				T value{};
+				if (data.size() >= sizeof(T))
+				{
+					std::memcpy(&value, data.data(), sizeof(T));
+					data.remove_prefix(sizeof(T));
+				}
+				return value;
+			}
+
+			std::string_view str()
+			{
+				const std::size_t len(std::min<std::size_t>(get<std::uint32_t>(), data.size()));
+				const std::string_view s(data.substr(0, len));
+				data.remove_prefix(len);
+				return s;
+			}
+
+			/// The bytes which have not been read yet.
+			std::string_view rest() const
+			{
+				return data;
+			}
+		};
+
+		/// Print a single argument.
+		static void print(std::ostream& _os, const Tag _tag, Reader& _reader)
+		{
+			switch (_tag)
+			{
+			case Tag::Int:
+				_os << _reader.get<std::int64_t>();
+				break;
+
+			case Tag::UInt:
+				_os << _reader.get<std::uint64_t>();
+				break;
+
+			case Tag::Float:
+				print_float(_os, _reader.get<double>());
+				break;
+
+			case Tag::Single:
+				print_float(_os, _reader.get<float>());
+				break;
+
+			case Tag::Bool:
+				_os << static_cast<bool>(_reader.get<char>());
+				break;
+
+			case Tag::Char:
+				_os << _reader.get<char>();
+				break;
+
+			case Tag::Literal:
+				_os << reinterpret_cast<const char*>(_reader.get<std::uint64_t>());
+				break;
+
+			case Tag::String:
+				_os << _reader.str();
+				break;
+
+			case Tag::Pointer:
+				_os << reinterpret_cast<const void*>(_reader.get<std::uint64_t>());
+				break;
+			}
+		}
+
+		/// Turn an encoded message into text.
+		static void print(std::ostream& _os, const Format& _format, const std::string_view _data)
+		{
+			Reader reader(_data);
+			reader.get<std::uint32_t>();
+			const std::string_view prefix(reader.str());
+			const std::string_view infix(reader.str());
+			const std::string_view suffix(reader.str());
+
+			for (std::size_t i = 0; i < _format.count; ++i)
+			{
+				_os << (i == 0 ? prefix : infix);
+				print(_os, _format.tags[i], reader);
+			}
+			_os << suffix;
+		}
+	};
+
+	/// Output file storing deferred messages in binary form.
+	/// The file starts with a header, followed by entries of
+	/// the following kinds:
+	///
+	/// - Format:  id, argument count, argument tags
+	/// - Literal: id, text of a string literal
+	/// - Affixes: id, prefix, infix, suffix
+	/// - Record:  format id, affix id, log level, argument values
+	/// - Text:    output formatted by dlog on the calling thread
+	///
+	/// Formats, literals and affix sets are written once, the first
+	/// time they are used, and referred to by id afterwards. Integers,
+	/// ids and lengths are stored as LEB128 varints (zigzag-encoded if
+	/// signed), floating-point numbers as native doubles.
+	/// Use dlog_decode to turn a binary log into text.
+	class BinaryFile : public std::ofstream
+	{
+	public:
+
+		enum class Entry : std::uint8_t
+		{
+			Format = 1,
+			Literal,
+			Affixes,
+			Record,
+			Text
+		};
+
+		/// Written at the start of each session, so
+		/// appending to an existing file is supported.
+		inline static const std::string magic{"DLOGBIN\x01", 8};
+
+	private:
+
+		hmap<const Format*, std::uint64_t> formats;
+
+		/// Ids of the literals written so far by address,
+		/// with their text. A literal is only reused if the
+		/// text at its address is still the same.
+		hmap<std::uint64_t, std::pair<std::uint64_t, std::string>> literals;
+
+		std::uint64_t literal_count{0};
+
+		hmap<std::string, std::uint64_t> affixes;
+
+		/// Encoded affixes of the current record,
+		/// reused as a lookup key.
+		std::string key;
+
+		/// The entry being assembled.
+		std::string entry;
+
+	public:
+
+		explicit BinaryFile(const std::string& _file_name, const std::ios::openmode _mode = std::ios::trunc)
+			:
+			  std::ofstream(_file_name, _mode | std::ios::out | std::ios::binary)
+		{
+			write(magic.data(), static_cast<std::streamsize>(magic.size()));
+		}
+
+		/// Store a deferred message.
+		void record(const Format& _format, const std::string_view _data)
+		{
+			Codec::Reader reader(_data);
+			const std::uint32_t level(reader.get<std::uint32_t>());
+
+			const std::string_view rest(reader.rest());
+			reader.str();
+			reader.str();
+			reader.str();
+			key.assign(rest.data(), rest.size() - reader.rest().size());
+
+			const std::uint64_t format_id(format(_format));
+			const std::uint64_t affix_id(affix());
+
+			entry.clear();
+			entry.push_back(static_cast<char>(Entry::Record));
+			varint(format_id);
+			varint(affix_id);
+			varint(level);
+
+			for (std::size_t i = 0; i < _format.count; ++i)
+			{
+				switch (_format.tags[i])
+				{
+				case Tag::Int:
+					varint(zigzag(reader.get<std::int64_t>()));
+					break;
+
+				case Tag::UInt:
+					varint(reader.get<std::uint64_t>());
+					break;
+
+				case Tag::Float:
+					raw(reader.get<double>());
+					break;
+
+				case Tag::Single:
+					raw(reader.get<float>());
+					break;
+
+				case Tag::Bool:
+				case Tag::Char:
+					entry.push_back(reader.get<char>());
+					break;
+
+				case Tag::Literal:
+					varint(literal(reader.get<std::uint64_t>()));
+					break;
+
+				case Tag::String:
+					string(reader.str());
+					break;
+
+				case Tag::Pointer:
+					varint(reader.get<std::uint64_t>());
+					break;
+				}
+			}
+			commit();
+		}
+
+		/// Store output formatted by dlog.
+		void text(const std::string_view _text)
+		{
+			entry.clear();
+			entry.push_back(static_cast<char>(Entry::Text));
+			string(_text);
+			commit();
+		}
+
+		/// Turn a binary log into text. Returns false
+		/// if the input is not a binary log or is truncated.
+		static bool decode(std::istream& _in, std::ostream& _out);
+
+	private:
+
+		static std::uint64_t zigzag(const std::int64_t _value)
+		{
+			return (static_cast<std::uint64_t>(_value) << 1) ^ static_cast<std::uint64_t>(_value >> 63);
+		}
+
+		void varint(std::uint64_t _value)
+		{
+			while (_value >= 0x80)
+			{
+				entry.push_back(static_cast<char>(_value | 0x80));
+				_value >>= 7;
+			}
+			entry.push_back(static_cast<char>(_value));
+		}
+
+		template<typename T>
+		void raw(const T _value)
+		{
+			entry.append(reinterpret_cast<const char*>(&_value), sizeof(T));
+		}
+
+		void string(const std::string_view _str)
+		{
+			varint(_str.size());
+			entry.append(_str);
+		}
+
+		void commit()
+		{
+			write(entry.data(), static_cast<std::streamsize>(entry.size()));
+		}
+
+		std::uint64_t format(const Format& _format)
+		{
+			const auto it(formats.find(&_format));
+			if (it != formats.end())
+			{
+				return it->second;
+			}
+
+			const std::uint64_t id(formats.size());
+			formats.emplace(&_format, id);
+			entry.clear();
+			entry.push_back(static_cast<char>(Entry::Format));
+			varint(id);
+			varint(_format.count);
+			entry.append(reinterpret_cast<const char*>(_format.tags), _format.count);
+			commit();
+			return id;
+		}
+
+		std::uint64_t literal(const std::uint64_t _address)
+		{
+			const std::string_view text(reinterpret_cast<const char*>(_address));
+			const auto it(literals.find(_address));
+			if (it != literals.end() && it->second.second == text)
+			{
+				return it->second.first;
+			}
+
+			const std::uint64_t id(literal_count++);
+			literals[_address] = {id, std::string(text)};
+
+			/// Keep the record being assembled intact.
+			std::string pending;
+			pending.swap(entry);
+			entry.push_back(static_cast<char>(Entry::Literal));
+			varint(id);
+			string(text);
+			commit();
+			pending.swap(entry);
+			return id;
+		}
+
+		std::uint64_t affix()
+		{
+			const auto it(affixes.find(key));
+			if (it != affixes.end())
+			{
+				return it->second;
+			}
+
+			const std::uint64_t id(affixes.size());
+			affixes.emplace(key, id);
+			entry.clear();
+			entry.push_back(static_cast<char>(Entry::Affixes));
+			varint(id);
+			Codec::Reader reader(key);
+			for (uint i = 0; i < 3; ++i)
+			{
+				string(reader.str());
+			}
+			commit();
+			return id;
+		}
+	};
+
+	inline bool BinaryFile::decode(std::istream& _in, std::ostream& _out)
+	{
+		struct Affixes
+		{
+			std::string prefix;
+			std::string infix;
+			std::string suffix;
+		};
+
+		std::vector<std::vector<Tag>> formats;
+		std::vector<std::string> literals;
+		std::vector<Affixes> affixes;
+		std::string str;
+
+		bool ok(true);
+
+		auto byte = [&]() -> int
+		{
+			const int ch(_in.get());
+			ok = ok && ch != std::char_traits<char>::eof();
+			return ch;
+		};
+
+		auto varint = [&]() -> std::uint64_t
+		{
+			std::uint64_t value(0);
+			for (uint shift = 0; shift < 64 && ok; shift += 7)
+			{
+				const int ch(byte());
+				value |= static_cast<std::uint64_t>(ch & 0x7f) << shift;
+				if ((ch & 0x80) == 0)
+				{
+					break;
+				}
+			}
+			return value;
+		};
+
+		/// Lengths and counts come from the file, which may be
+		/// damaged, so strings are read in chunks and only grow
+		/// as far as the input actually goes.
+		auto string = [&]() -> const std::string&
+		{
+			constexpr std::uint64_t chunk{1 << 16};
+			str.clear();
+			for (std::uint64_t left = varint(); left > 0 && ok;)
+			{
+				const std::size_t at(str.size());
+				const std::size_t count(static_cast<std::size_t>(std::min(left, chunk)));
+				str.resize(at + count);
+				_in.read(str.data() + at, static_cast<std::streamsize>(count));
+				const std::size_t got(static_cast<std::size_t>(_in.gcount()));
+				str.resize(at + got);
+				ok = got == count;
+				left -= got;
+			}
+			return str;
+		};
+
+		/// Entries are numbered in the order they are written,
+		/// so an id can at most be one past the last one.
+		auto valid = [](const std::uint64_t _id, const std::size_t _size)
+		{
+			return _id <= _size;
+		};
+
+		auto header = [&]()
+		{
+			std::string head(magic.size(), '\0');
+			_in.read(head.data(), static_cast<std::streamsize>(head.size()));
+			formats.clear();
+			literals.clear();
+			affixes.clear();
+			return _in.gcount() == static_cast<std::streamsize>(head.size()) && head == magic;
+		};
+
+		if (!header())
+		{
+			return false;
+		}
+
+		while (ok && _in.peek() != std::char_traits<char>::eof())
+		{
+			if (_in.peek() == magic.front())
+			{
+				/// A new session appended to the file.
+				ok = header();
+				continue;
+			}
+
+			switch (static_cast<Entry>(byte()))
+			{
+			case Entry::Format:
+				{
+					const std::uint64_t id(varint());
+					if (!valid(id, formats.size()))
+					{
+						return false;
+					}
+					std::vector<Tag> tags;
+					for (std::uint64_t count = varint(); count > 0 && ok; --count)
+					{
+						const int tag(byte());
+						if (ok)
+						{
+							tags.push_back(static_cast<Tag>(tag));
+						}
+					}
+					formats.resize(std::max<std::size_t>(formats.size(), id + 1));
+					formats[id] = std::move(tags);
+				}
+				break;
+
+			case Entry::Literal:
+				{
+					const std::uint64_t id(varint());
+					if (!valid(id, literals.size()))
+					{
+						return false;
+					}
+					literals.resize(std::max<std::size_t>(literals.size(), id + 1));
+					literals[id] = string();
+				}
+				break;
+
+			case Entry::Affixes:
+				{
+					const std::uint64_t id(varint());
+					if (!valid(id, affixes.size()))
+					{
+						return false;
+					}
+					Affixes afx;
+					afx.prefix = string();
+					afx.infix = string();
+					afx.suffix = string();
+					affixes.resize(std::max<std::size_t>(affixes.size(), id + 1));
+					affixes[id] = std::move(afx);
+				}
+				break;
+
+			case Entry::Record:
+				{
+					const std::uint64_t format_id(varint());
+					const std::uint64_t affix_id(varint());
+					varint();
+					if (format_id >= formats.size() || affix_id >= affixes.size())
+					{
+						return false;
+					}
+
+					const Affixes& afx(affixes[affix_id]);
+					const std::vector<Tag>& tags(formats[format_id]);
+					for (std::size_t i = 0; i < tags.size() && ok; ++i)
+					{
+						_out << (i == 0 ? afx.prefix : afx.infix);
+						switch (tags[i])
+						{
+						case Tag::Int:
+							{
+								const std::uint64_t v(varint());
+								_out << static_cast<std::int64_t>((v >> 1) ^ (~(v & 1) + 1));
+							}
+							break;
+
+						case Tag::UInt:
+							_out << varint();
+							break;
+
+						case Tag::Float:
+							{
+								double v(0);
+								_in.read(reinterpret_cast<char*>(&v), sizeof(v));
+								ok = ok && _in.gcount() == sizeof(v);
+								print_float(_out, v);
+							}
+							break;
+
+						case Tag::Single:
+							{
+								float v(0);
+								_in.read(reinterpret_cast<char*>(&v), sizeof(v));
+								ok = ok && _in.gcount() == sizeof(v);
+								print_float(_out, v);
+							}
+							break;
+
+						case Tag::Bool:
+							_out << static_cast<bool>(byte());
+							break;
+
+						case Tag::Char:
+							_out << static_cast<char>(byte());
+							break;
+
+						case Tag::Literal:
+							{
+								const std::uint64_t id(varint());
+								_out << (id < literals.size() ? literals[id] : std::string());
+							}
+							break;
+
+						case Tag::String:
+							_out << string();
+							break;
+
+						case Tag::Pointer:
+							_out << reinterpret_cast<const void*>(varint());
+							break;
+
+						default:
+							return false;
+						}
+					}
+					_out << afx.suffix;
+				}
+				break;
+
+			case Entry::Text:
+				_out << string();
+				break;
+
+			default:
+				return false;
+			}
+		}
+		return ok;
+	}
+
+#ifdef DLOG_HAS_MMAP
+
+	/// Output file which is written through a shared memory mapping,
+	/// so records are copied straight into the page cache without
+	/// a system call per write. The file starts with a header of
+	/// header_size bytes which holds the number of bytes committed
+	/// so far. The count is updated after every write, so if the
+	/// process is killed, the file can be recovered up to the last
+	/// complete record with MappedFile::recover() or dlog_decode.
+	/// Reopening an existing mapped file appends to its committed
+	/// content. The mapping grows in steps of the given chunk size.
+	class MappedFile : public std::ostream
+	{
+	public:
+
+		static constexpr std::size_t header_size{64};
+
+		inline static const std::string magic{"DLOGMAP\x01", 8};
+
+	private:
+
+		class Map : public std::streambuf
+		{
+			int fd{-1};
+
+			/// Start and size of the mapping.
+			char* base{nullptr};
+			std::size_t size{0};
+
+			std::size_t chunk{0};
+
+		public:
+
+			Map(const std::string& _file_name, const std::size_t _chunk)
+			{
+				const std::size_t page(static_cast<std::size_t>(::sysconf(_SC_PAGESIZE)));
+				chunk = std::max(page, (_chunk + page - 1) / page * page);
+
+				fd = ::open(_file_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+				if (fd < 0)
+				{
+					return;
+				}
+
+				/// Resume after the committed content of an existing file.
+				std::uint64_t committed(0);
+				char head[header_size];
+				const bool resume(::pread(fd, head, header_size, 0) == static_cast<ssize_t>(header_size) &&
+								  std::string_view(head, magic.size()) == magic);
+				if (resume)
+				{
+					std::memcpy(&committed, head + magic.size(), sizeof(committed));
+				}
+
+				if (!map(header_size + static_cast<std::size_t>(committed)))
+				{
+					return;
+				}
+
+				if (!resume)
+				{
+					std::memset(base, 0, header_size);
+					std::memcpy(base, magic.data(), magic.size());
+				}
+				seek(static_cast<std::size_t>(committed));
+				commit();
+			}
+
+			~Map()
+			{
+				if (base != nullptr)
+				{
+					commit();
+					const std::size_t length(header_size + offset());
+					::munmap(base, size);
+					/// Drop the unused part of the last chunk.
+					[[maybe_unused]] const int rc(::ftruncate(fd, static_cast<off_t>(length)));
+				}
+
+				if (fd >= 0)
+				{
+					::close(fd);
+				}
+			}
+
+			bool is_open() const
+			{
+				return base != nullptr;
+			}
+
+		protected:
+
+			std::streamsize xsputn(const char* _str, std::streamsize _count) override
+			{
+				if (epptr() - pptr() < _count && !grow(static_cast<std::size_t>(_count)))
+				{
+					return 0;
+				}
+				std::memcpy(pptr(), _str, static_cast<std::size_t>(_count));
+				seek(offset() + static_cast<std::size_t>(_count));
+				commit();
+				return _count;
+			}
+
+			int_type overflow(int_type _ch) override
+			{
+				if (traits_type::eq_int_type(_ch, traits_type::eof()))
+				{
+					return traits_type::not_eof(_ch);
+				}
+
+				if (!grow(1))
+				{
+					return traits_type::eof();
+				}
+				*pptr() = traits_type::to_char_type(_ch);
+				pbump(1);
+				commit();
+				return _ch;
+			}
+
+			int sync() override
+			{
+				if (base == nullptr)
+				{
+					return -1;
+				}
+				commit();
+				return ::msync(base, size, MS_ASYNC) == 0 ? 0 : -1;
+			}
+
+		private:
+
+			/// Number of bytes written after the header.
+			std::size_t offset() const
+			{
+				return static_cast<std::size_t>(pptr() - (base + header_size));
+			}
+
+			void seek(std::size_t _offset)
+			{
+				setp(base + header_size, base + size);
+				while (_offset > 0)
+				{
+					const int step(static_cast<int>(std::min<std::size_t>(_offset, std::numeric_limits<int>::max())));
+					pbump(step);
+					_offset -= static_cast<std::size_t>(step);
+				}
+			}
+
+			/// Publish everything written so far.
+			void commit()
+			{
+				reinterpret_cast<std::atomic<std::uint64_t>*>(base + magic.size())->store(offset(), std::memory_order_release);
+			}
+
+			/// Map enough of the file to hold _length bytes plus a chunk.
+			bool map(const std::size_t _length)
+			{
+				const std::size_t new_size((_length + chunk) / chunk * chunk);
+				if (::ftruncate(fd, static_cast<off_t>(new_size)) != 0)
+				{
+					return false;
+				}
+
+				void* mem(::mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+				if (mem == MAP_FAILED)
+				{
+					return false;
+				}
+
+				if (base != nullptr)
+				{
+					::munmap(base, size);
+				}
+				base = static_cast<char*>(mem);
+				size = new_size;
+				return true;
+			}
+
+			bool grow(const std::size_t _extra)
+			{
+				const std::size_t used(offset());
+				if (!map(header_size + used + _extra))
+				{
+					return false;
+				}
+				seek(used);
+				return true;
+			}
+		};
+
+		Map map;
+
+	public:
+
+		explicit MappedFile(const std::string& _file_name, const std::size_t _chunk = 1 << 20)
+			:
+			  std::ostream(&map),
+			  map(_file_name, _chunk)
+		{
+			if (!map.is_open())
+			{
+				setstate(std::ios::badbit);
+			}
+		}
+
+		bool is_open() const
+		{
+			return map.is_open();
+		}
+
+		/// Copy the committed content of a mapped file to _out.
+		/// Returns false if the input is not a mapped file.
+		static bool recover(std::istream& _in, std::ostream& _out)
+		{
+			char head[header_size];
+			_in.read(head, header_size);
+			if (_in.gcount() != static_cast<std::streamsize>(header_size) ||
+				std::string_view(head, magic.size()) != magic)
+			{
+				return false;
+			}
+
+			std::uint64_t committed(0);
+			std::memcpy(&committed, head + magic.size(), sizeof(committed));
+
+			std::array<char, 1 << 16> chunk;
+			while (committed > 0 && _in)
+			{
+				_in.read(chunk.data(), static_cast<std::streamsize>(std::min<std::uint64_t>(committed, chunk.size())));
+				_out.write(chunk.data(), _in.gcount());
+				committed -= static_cast<std::uint64_t>(_in.gcount());
+			}
+			return committed == 0;
+		}
+
+		static bool recover(const std::string& _file_name, std::ostream& _out)
+		{
+			std::ifstream in(_file_name, std::ios::in | std::ios::binary);
+			return recover(in, _out);
+		}
+	};
+
+#endif
+
+#ifdef DLOG_HAS_MMAP
+
+	/// Output file or file descriptor which collects records
+	/// in memory and submits them with a single writev() call
+	/// per batch, so the number of system calls depends on the
+	/// number of batches rather than the number of records.
+	/// A batch is submitted when it reaches the given size, when
+	/// the stream is flushed (the printer flushes the streams it
+	/// has written to after each pass in async mode), and when
+	/// the stream is destroyed.
+	class BatchFile : public std::ostream
+	{
+		class Batch : public std::streambuf
+		{
+			static constexpr std::size_t chunk_size{1 << 16};
+
+			int fd{-1};
+
+			bool owned{false};
+
+			/// Chunks holding the batch. They are kept
+			/// between batches, so their memory is reused.
+			std::vector<std::unique_ptr<char[]>> chunks;
+
+			/// Index of the chunk being filled.
+			std::size_t current{0};
+
+			/// Maximum number of chunks in a batch.
+			std::size_t limit{1};
+
+			std::vector<iovec> iov;
+
+		public:
+
+			Batch(const int _fd, const bool _owned, const std::size_t _batch_size)
+				:
+				  fd(_fd),
+				  owned(_owned),
+				  limit(std::clamp<std::size_t>(_batch_size / chunk_size, 1, IOV_MAX))
+			{
+				chunks.emplace_back(new char[chunk_size]);
+				setp(chunks[0].get(), chunks[0].get() + chunk_size);
+			}
+
+			~Batch()
+			{
+				submit();
+				if (owned && fd >= 0)
+				{
+					::close(fd);
+				}
+			}
+
+			bool is_open() const
+			{
+				return fd >= 0;
+			}
+
+		protected:
+
+			int_type overflow(int_type _ch) override
+			{
+				if (traits_type::eq_int_type(_ch, traits_type::eof()))
+				{
+					return traits_type::not_eof(_ch);
+				}
+
+				if (current + 1 == limit)
+				{
+					if (!submit())
+					{
+						return traits_type::eof();
+					}
+				}
+				else
+				{
+					if (++current == chunks.size())
+					{
+						chunks.emplace_back(new char[chunk_size]);
+					}
+					setp(chunks[current].get(), chunks[current].get() + chunk_size);
+				}
+
+				*pptr() = traits_type::to_char_type(_ch);
+				pbump(1);
+				return _ch;
+			}
+
+			int sync() override
+			{
+				return submit() ? 0 : -1;
+			}
+
+		private:
+
+			/// Write out the batch.
+			bool submit()
+			{
+				iov.clear();
+				for (std::size_t i = 0; i < current; ++i)
+				{
+					iov.push_back({chunks[i].get(), chunk_size});
+				}
+				iov.push_back({chunks[current].get(), static_cast<std::size_t>(pptr() - chunks[current].get())});
+
+				current = 0;
+				setp(chunks[0].get(), chunks[0].get() + chunk_size);
+
+				iovec* first(iov.data());
+				std::size_t count(iov.size());
+				while (count > 0 && fd >= 0)
+				{
+					const ssize_t written(::writev(fd, first, static_cast<int>(count)));
+					if (written < 0)
+					{
+						if (errno == EINTR)
+						{
+							continue;
+						}
+						return false;
+					}
+
+					/// Skip what has been written after a short write.
+					std::size_t done(static_cast<std::size_t>(written));
+					while (count > 0 && done >= first->iov_len)
+					{
+						done -= first->iov_len;
+						++first;
+						--count;
+					}
+					if (count > 0)
+					{
+						first->iov_base = static_cast<char*>(first->iov_base) + done;
+						first->iov_len -= done;
+					}
+				}
+				return true;
+			}
+		};
+
+		Batch batch;
+
+	public:
+
+		/// Write to a file, appending to it unless _mode includes std::ios::trunc.
+		explicit BatchFile(const std::string& _file_name, const std::size_t _batch_size = 1 << 20, const std::ios::openmode _mode = std::ios::app)
+			:
+			  std::ostream(&batch),
+			  batch(::open(_file_name.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | ((_mode & std::ios::trunc) ? O_TRUNC : O_APPEND), 0644), true, _batch_size)
+		{
+			if (!batch.is_open())
+			{
+				setstate(std::ios::badbit);
+			}
+		}
+
+		/// Write to a file descriptor which stays open
+		/// when the stream is destroyed (for example STDOUT_FILENO).
+		explicit BatchFile(const int _fd, const std::size_t _batch_size = 1 << 20)
+			:
+			  std::ostream(&batch),
+			  batch(_fd, false, _batch_size)
+		{
+			if (!batch.is_open())
+			{
+				setstate(std::ios::badbit);
+			}
+		}
+
+		bool is_open() const
+		{
+			return batch.is_open();
+		}
+	};
+
+#endif
+
+#ifdef DLOG_HAS_MMAP
+
+	/// Output file which rolls over to a new file when it reaches
+	/// a given size or at the end of each interval of wall-clock
+	/// time, keeping a given number of files. The files are named
+	/// <base>.0, <base>.1, ... and a new session continues after
+	/// the highest index found. The next file is created (and
+	/// preallocated where supported) by a background thread before
+	/// it is needed, so rolling over only exchanges file descriptors.
+	/// If the next file is not ready in time, output continues in
+	/// the current file until it is. Files are only switched between
+	/// two writes, and dlog writes each record with a single write,
+	/// so records are never split across files.
+	class RotatingFile : public std::ostream
+	{
+		class Roller : public std::streambuf
+		{
+			static constexpr std::size_t buffer_size{1 << 16};
+
+			std::string base;
+
+			std::size_t max_size{0};
+
+			std::chrono::seconds interval{0};
+
+			std::size_t keep{1};
+
+			std::unique_ptr<char[]> buffer{new char[buffer_size]};
+
+			/// Current file, its index and the bytes written to it.
+			int fd{-1};
+			std::uint64_t index{0};
+			std::size_t size{0};
+
+			/// End of the current interval.
+			std::chrono::system_clock::time_point deadline;
+
+			/// Next file, opened by the background thread
+			/// (-1 while it is not ready).
+			std::atomic<int> next{-1};
+
+			/// Work for the background thread.
+			std::mutex mutex;
+			std::condition_variable wake;
+			std::vector<std::pair<int, std::size_t>> closing;
+			std::uint64_t prepare{0};
+			std::atomic<bool> pending{false};
+			bool stopping{false};
+
+			/// Oldest file which has not been removed.
+			std::uint64_t oldest{0};
+
+			std::thread worker;
+
+		public:
+
+			Roller(const std::string& _base, const std::size_t _max_size, const std::chrono::seconds _interval, const std::size_t _keep)
+				:
+				  base(_base),
+				  max_size(_max_size),
+				  interval(_interval),
+				  keep(std::max<std::size_t>(_keep, 1))
+			{
+				scan();
+				fd = create(index);
+				if (fd < 0)
+				{
+					return;
+				}
+				deadline = boundary();
+				setp(buffer.get(), buffer.get() + buffer_size);
+				worker = std::thread([this]{ run(); });
+				request(index + 1);
+			}
+
+			~Roller()
+			{
+				drain();
+				if (worker.joinable())
+				{
+					{
+						glock lk(mutex);
+						stopping = true;
+					}
+					wake.notify_one();
+					worker.join();
+				}
+
+				/// Remove the next file if it was never used.
+				const int unused(next.exchange(-1));
+				if (unused >= 0)
+				{
+					::close(unused);
+					::unlink(name(index + 1).c_str());
+				}
+
+				if (fd >= 0)
+				{
+					::close(fd);
+				}
+			}
+
+			bool is_open() const
+			{
+				return fd >= 0;
+			}
+
+			std::string current() const
+			{
+				return name(index);
+			}
+
+		protected:
+
+			int_type overflow(int_type _ch) override
+			{
+				if (traits_type::eq_int_type(_ch, traits_type::eof()))
+				{
+					return traits_type::not_eof(_ch);
+				}
+				const char ch(traits_type::to_char_type(_ch));
+				return xsputn(&ch, 1) == 1 ? _ch : traits_type::eof();
+			}
+
+			std::streamsize xsputn(const char* _s, std::streamsize _n) override
+			{
+				if (fd < 0)
+				{
+					return 0;
+				}
+
+				const std::size_t n(static_cast<std::size_t>(_n));
+				if ((max_size > 0 && size > 0 && size + n > max_size) ||
+					(interval.count() > 0 && std::chrono::system_clock::now() >= deadline))
+				{
+					roll();
+				}
+
+				if (n > static_cast<std::size_t>(epptr() - pptr()))
+				{
+					if (!drain())
+					{
+						return 0;
+					}
+					if (n >= buffer_size)
+					{
+						if (!write_all(fd, _s, n))
+						{
+							return 0;
+						}
+						size += n;
+						return _n;
+					}
+				}
+				std::memcpy(pptr(), _s, n);
+				pbump(static_cast<int>(n));
+				size += n;
+				return _n;
+			}
+
+			int sync() override
+			{
+				return drain() ? 0 : -1;
+			}
+
+		private:
+
+			std::string name(const std::uint64_t _index) const
+			{
+				return base + "." + std::to_string(_index);
+			}
+
+			/// Find the files left by earlier sessions.
+			void scan()
+			{
+				const std::size_t slash(base.rfind('/'));
+				const std::string dir(slash == std::string::npos ? "." : base.substr(0, std::max<std::size_t>(slash, 1)));
+				const std::string prefix((slash == std::string::npos ? base : base.substr(slash + 1)) + ".");
+
+				bool found(false);
+				std::uint64_t low(0);
+				std::uint64_t high(0);
+				if (DIR* d = ::opendir(dir.c_str()))
+				{
+					while (const dirent* entry = ::readdir(d))
+					{
+						const std::string_view file(entry->d_name);
+						if (file.size() <= prefix.size() ||
+							file.substr(0, prefix.size()) != prefix ||
+							file.find_first_not_of("0123456789", prefix.size()) != std::string_view::npos)
+						{
+							continue;
+						}
+						const std::uint64_t i(std::stoull(std::string(file.substr(prefix.size()))));
+						low = found ? std::min(low, i) : i;
+						high = found ? std::max(high, i) : i;
+						found = true;
+					}
+					::closedir(d);
+				}
+
+				index = found ? high + 1 : 0;
+				oldest = found ? low : 0;
+			}
+
+			int create(const std::uint64_t _index) const
+			{
+				return ::open(name(_index).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+			}
+
+			/// Start of the next interval, aligned to multiples
+			/// of the interval since the epoch.
+			std::chrono::system_clock::time_point boundary() const
+			{
+				if (interval.count() == 0)
+				{
+					return std::chrono::system_clock::time_point::max();
+				}
+				const auto now(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()));
+				return std::chrono::system_clock::time_point((now / interval + 1) * interval);
+			}
+
+			/// Switch to the next file if it is ready.
+			void roll()
+			{
+				const int ready(next.exchange(-1, std::memory_order_acq_rel));
+				if (ready < 0)
+				{
+					/// Keep writing to the current file and try
+					/// again on the next write.
+					request(index + 1);
+					return;
+				}
+
+				drain();
+				const int old(fd);
+				const std::size_t old_size(size);
+				fd = ready;
+				++index;
+				size = 0;
+				deadline = boundary();
+
+				{
+					glock lk(mutex);
+					closing.emplace_back(old, old_size);
+				}
+				request(index + 1);
+			}
+
+			/// Ask the background thread to create file _index.
+			void request(const std::uint64_t _index)
+			{
+				if (pending.load(std::memory_order_acquire))
+				{
+					return;
+				}
+				{
+					glock lk(mutex);
+					prepare = _index;
+					pending.store(true, std::memory_order_release);
+				}
+				wake.notify_one();
+			}
+
+			void run()
+			{
+				ulock lk(mutex);
+				while (true)
+				{
+					wake.wait(lk, [&]{ return stopping || pending.load(std::memory_order_relaxed) || !closing.empty(); });
+
+					std::vector<std::pair<int, std::size_t>> old;
+					old.swap(closing);
+					const bool create_next(pending.load(std::memory_order_relaxed) && next.load(std::memory_order_acquire) < 0);
+					const std::uint64_t target(prepare);
+					pending.store(false, std::memory_order_release);
+					const bool stop(stopping);
+					lk.unlock();
+
+					for (const auto& [file, length] : old)
+					{
+						/// Release space preallocated beyond the end.
+						[[maybe_unused]] const int rc(::ftruncate(file, static_cast<off_t>(length)));
+						::close(file);
+					}
+
+					if (create_next && !stop)
+					{
+						const int file(create(target));
+						if (file >= 0)
+						{
+#ifdef FALLOC_FL_KEEP_SIZE
+							if (max_size > 0)
+							{
+								[[maybe_unused]] const int rc(::fallocate(file, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(max_size)));
+							}
+#endif
+							next.store(file, std::memory_order_release);
+						}
+					}
+
+					/// Remove files beyond the number to keep.
+					/// The current file is target - 1.
+					while (create_next && oldest + keep < target)
+					{
+						::unlink(name(oldest++).c_str());
+					}
+
+					lk.lock();
+					if (stop)
+					{
+						break;
+					}
+				}
+			}
+
+			/// Write out the buffer.
+			bool drain()
+			{
+				const std::size_t length(static_cast<std::size_t>(pptr() - pbase()));
+				setp(buffer.get(), buffer.get() + buffer_size);
+				return length == 0 || write_all(fd, buffer.get(), length);
+			}
+
+			static bool write_all(const int _fd, const char* _data, std::size_t _length)
+			{
+				while (_length > 0 && _fd >= 0)
+				{
+					const ssize_t written(::write(_fd, _data, _length));
+					if (written < 0)
+					{
+						if (errno == EINTR)
+						{
+							continue;
+						}
+						return false;
+					}
+					_data += written;
+					_length -= static_cast<std::size_t>(written);
+				}
+				return _fd >= 0;
+			}
+		};
+
+		Roller roller;
+
+	public:
+
+		/// Roll over when the file would grow beyond _max_size bytes
+		/// (0 for no limit) and at the end of every _interval (0 for
+		/// no time limit), keeping the last _keep files.
+		explicit RotatingFile(const std::string& _base, const std::size_t _max_size, const std::chrono::seconds _interval = std::chrono::seconds(0), const std::size_t _keep = 8)
+			:
+			  std::ostream(&roller),
+			  roller(_base, _max_size, _interval, _keep)
+		{
+			if (!roller.is_open())
+			{
+				setstate(std::ios::badbit);
+			}
+		}
+
+		bool is_open() const
+		{
+			return roller.is_open();
+		}
+
+		/// Name of the file being written to.
+		std::string current() const
+		{
+			return roller.current();
+		}
+	};
+
+#endif
+
+	/// Set of streams receiving the same output.
+	/// A message logged to a Tee is formatted once,
+	/// and the same text is written to each of its
+	/// streams (in async mode, by the printer from the
+	/// single record in the ring). Each stream is locked
+	/// separately and keeps its own log level, so the same
+	/// streams can also be logged to directly.
+	/// Streams must be added before the tee is logged to.
+	class Tee : public std::ostream
+	{
+		/// Forwards output written to the
+		/// tee directly to all of its streams.
+		class Splitter : public std::streambuf
+		{
+		public:
+
+			std::vector<std::ostream*> streams;
+
+		protected:
+
+			int_type overflow(int_type _ch) override
+			{
+				if (!traits_type::eq_int_type(_ch, traits_type::eof()))
+				{
+					const char ch(traits_type::to_char_type(_ch));
+					for (std::ostream* os : streams)
+					{
+						os->write(&ch, 1);
+					}
+				}
+				return traits_type::not_eof(_ch);
+			}
+
+			std::streamsize xsputn(const char* _s, std::streamsize _n) override
+			{
+				for (std::ostream* os : streams)
+				{
+					os->write(_s, _n);
+				}
+				return _n;
+			}
+
+			int sync() override
+			{
+				for (std::ostream* os : streams)
+				{
+					os->flush();
+				}
+				return 0;
+			}
+		};
+
+		Splitter splitter;
+
+		/// Streams kept alive by the tee.
+		std::vector<std::shared_ptr<std::ostream>> owned;
+
+	public:
+
+		template<typename ... Streams>
+		explicit Tee(Streams&& ... _streams)
+			:
+			  std::ostream(&splitter)
+		{
+			(add(std::forward<Streams>(_streams)), ...);
+		}
+
+		Tee& add(std::ostream& _stream)
+		{
+			splitter.streams.push_back(std::addressof(_stream));
+			return *this;
+		}
+
+		template<typename Stream, typename = std::enable_if_t<std::is_base_of_v<std::ostream, Stream>>>
+		Tee& add(std::shared_ptr<Stream> _stream)
+		{
+			splitter.streams.push_back(_stream.get());
+			owned.push_back(std::move(_stream));
+			return *this;
+		}
+
+		const std::vector<std::ostream*>& streams() const
+		{
+			return splitter.streams;
+		}
+	};
+
+	///=====================================
+	/// Rate limiting
+	///=====================================
+
+	/// State of a rate-limited call site (see DLOG_EVERY_N,
+	/// DLOG_FIRST_N and DLOG_EVERY). Each check returns the
+	/// number of messages suppressed at the site since it
+	/// last passed, or Site::closed if the message should
+	/// be suppressed.
+	class alignas(cache_line) Site
+	{
+		/// Messages seen at the site.
+		std::atomic<std::uint64_t> count{0};
+
+		/// Messages suppressed since the site
+		/// last passed (DLOG_EVERY only).
+		std::atomic<std::uint64_t> skipped{0};
+
+		/// Time at which the next message can pass,
+		/// in nanoseconds of the steady clock.
+		std::atomic<std::int64_t> due{std::numeric_limits<std::int64_t>::min()};
+
+	public:
+
+		static constexpr std::uint64_t closed{std::numeric_limits<std::uint64_t>::max()};
+
+		/// Pass the first of every _n messages.
+		std::uint64_t every_n(const std::uint64_t _n)
+		{
+			const std::uint64_t seen(count.fetch_add(1, std::memory_order_relaxed));
+			if (_n <= 1 || seen == 0)
+			{
+				return 0;
+			}
+			return seen % _n == 0 ? _n - 1 : closed;
+		}
+
+		/// Pass the first _n messages.
+		std::uint64_t first_n(const std::uint64_t _n)
+		{
+			/// Once the site is closed, it is
+			/// only read, so the counter stops
+			/// bouncing between threads.
+			if (count.load(std::memory_order_relaxed) >= _n)
+			{
+				return closed;
+			}
+			return count.fetch_add(1, std::memory_order_relaxed) < _n ? 0 : closed;
+		}
+
+		/// Pass at most one message per _interval.
+		template<typename Rep, typename Period>
+		std::uint64_t every(const std::chrono::duration<Rep, Period> _interval)
+		{
+			using std::chrono::duration_cast;
+			using std::chrono::nanoseconds;
+
+			const std::int64_t now(duration_cast<nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+			std::int64_t next(due.load(std::memory_order_relaxed));
+			if (now < next ||
+				!due.compare_exchange_strong(next, now + duration_cast<nanoseconds>(_interval).count(), std::memory_order_relaxed))
+			{
+				skipped.fetch_add(1, std::memory_order_relaxed);
+				return closed;
+			}
+			return skipped.exchange(0, std::memory_order_relaxed);
+		}
+	};
+
+	/// @class The dlog class.
+	/// @details
+	/// dlog ("debug log") is a tiny header-only library
+	/// for printing output from multiple threads to
+	/// arbitrary streams without garbling the output.
+	class dlog
+	{
+
+	public:
+
+		/// Version string.
+		inline static const std::string version{"0.2.4"};
+
+		/// What happens to a record in async mode when the
+		/// ring of the logging thread is full (see set_backpressure()).
+		enum class Backpressure : uint
+		{
+			/// Wait for the printer to catch up.
+			Block,
+
+			/// Drop the new record.
+			DropNewest,
+
+			/// Drop the oldest record in the ring to make room,
+			/// unless that record is for a stream which blocks.
+			DropOldest,
+
+			/// Drop the new record if it is below a
+			/// given log level, otherwise block.
+			Shed
+		};
+
+		/// How messages are written to a stream (see set_encoding()).
+		enum class Encoding : uint
+		{
+			/// The arguments joined with the affixes.
+			Text,
+
+			/// One JSON object per line.
+			Json,
+
+			/// One line of key=value pairs.
+			Logfmt
+		};
+
+		/// Snapshot of the counters kept by the write path
+		/// (see stats()). Times are in nanoseconds.
+		struct Stats
+		{
+			/// Records written and their size.
+			std::uint64_t records{0};
+			std::uint64_t bytes{0};
+
+			/// Time spent waiting for stream locks
+			/// and the longest single wait.
+			std::uint64_t lock_wait{0};
+			std::uint64_t max_lock_wait{0};
+
+			/// Time spent writing to streams, including
+			/// the flushes made by the printer.
+			std::uint64_t write_time{0};
+
+			/// Records dropped because a ring was full.
+			std::uint64_t dropped{0};
+
+			struct Stream
+			{
+				/// nullptr for the streams sharing the
+				/// overflow slot of the registry.
+				const std::ostream* stream{nullptr};
+				std::uint64_t records{0};
+				std::uint64_t bytes{0};
+				std::uint64_t dropped{0};
+
+				/// Time spent waiting for the lock of
+				/// the stream and writing to it.
+				std::uint64_t lock_wait{0};
+				std::uint64_t write_time{0};
+			};
+
+			std::vector<Stream> streams;
+		};
+
+	private:
+
+		/// Log level shared by all streams. It is read on every
+		/// call, so it is kept on a cache line of its own.
+		struct alignas(cache_line) Threshold
+		{
+			std::atomic<uint> level{0};
+
+			/// Set once any stream has been
+			/// given a log level of its own.
+			std::atomic<bool> per_stream{false};
+
+			/// Set once any stream has been
+			/// given an encoding of its own.
+			std::atomic<bool> encoded{false};
+		};
+
+		/// Default log level.
+		static Threshold log_level;
+
+		/// Streams which records are written to in a way of their own.
+		enum class Kind : uint
+		{
+			Plain,
+			Tee,
+			Binary
+		};
+
+		/// Output stream and the mutex
+		/// which serialises writes to it.
+		struct Sink
+		{
+			alignas(cache_line) std::atomic<std::ostream*> stream{nullptr};
+
+			std::mutex mutex;
+
+			/// Log level of this stream. Messages must pass
+			/// both this and the global log level.
+			std::atomic<uint> log_level{0};
+
+			/// Records and bytes written to this stream, and the
+			/// time spent waiting for the mutex and writing.
+			/// Only updated with the mutex held.
+			std::atomic<std::uint64_t> records{0};
+			std::atomic<std::uint64_t> bytes{0};
+			std::atomic<std::uint64_t> lock_wait{0};
+			std::atomic<std::uint64_t> write_time{0};
+
+			/// Policy for full rings in async mode.
+			std::atomic<Backpressure> backpressure{Backpressure::Block};
+			std::atomic<uint> shed_level{0};
+
+			/// Records dropped under the policy.
+			std::atomic<std::uint64_t> dropped{0};
+
+			std::atomic<Encoding> encoding{Encoding::Text};
+
+			/// Kind of the stream, found out once when it is
+			/// registered rather than for every record.
+			std::atomic<Kind> kind{Kind::Plain};
+
+			/// Set if runs of identical records are collapsed.
+			std::atomic<bool> collapse{false};
+
+			/// Last record written (without its layout) and its
+			/// hash, the number of repeats of it not reported yet
+			/// and the time of the last report. Only used with
+			/// the mutex held.
+			std::string last;
+			std::uint64_t last_hash{0};
+			std::uint64_t repeats{0};
+			std::chrono::steady_clock::time_point noted_at{};
+
+			/// Restore the state of an unused slot.
+			/// Called with the mutex held.
+			void reset()
+			{
+				log_level.store(0, std::memory_order_relaxed);
+				records.store(0, std::memory_order_relaxed);
+				bytes.store(0, std::memory_order_relaxed);
+				lock_wait.store(0, std::memory_order_relaxed);
+				write_time.store(0, std::memory_order_relaxed);
+				backpressure.store(Backpressure::Block, std::memory_order_relaxed);
+				shed_level.store(0, std::memory_order_relaxed);
+				dropped.store(0, std::memory_order_relaxed);
+				reported = 0;
+				reported_at = {};
+				encoding.store(Encoding::Text, std::memory_order_relaxed);
+				kind.store(Kind::Plain, std::memory_order_relaxed);
+				collapse.store(false, std::memory_order_relaxed);
+				last.clear();
+				last_hash = 0;
+				repeats = 0;
+				noted_at = {};
+			}
+
+			/// Dropped records reported so far and the time
+			/// of the last report. Only used by the printer.
+			std::uint64_t reported{0};
+			std::chrono::steady_clock::time_point reported_at{};
+		};
+
+		/// Registry of output streams.
+		/// Streams are registered on first use by claiming
+		/// a slot in an open-addressing table. Lookups of
+		/// registered streams are lock-free, so only the
+		/// mutex of the stream being written to is ever
+		/// locked. Registering a stream and releasing the
+		/// slot of a stream which has been destroyed are
+		/// serialised by the mutex of the registry.
+		class Registry
+		{
+			std::array<Sink, DLOG_MAX_STREAMS> sinks;
+
+			/// Shared by all streams registered
+			/// after the table has filled up.
+			Sink overflow;
+
+			std::mutex mutex;
+
+			static_assert((DLOG_MAX_STREAMS & (DLOG_MAX_STREAMS - 1)) == 0, "DLOG_MAX_STREAMS must be a power of two");
+
+			static std::size_t slot(const std::ostream* _os)
+			{
+				std::uint64_t h(reinterpret_cast<std::uintptr_t>(_os) >> 4);
+				h *= 0x9e3779b97f4a7c15ull;
+				return static_cast<std::size_t>(h ^ (h >> 32));
+			}
+
+			/// Marks a released slot. Lookups probe past it,
+			/// and the next stream registered can reuse it.
+			static std::ostream* released()
+			{
+				return reinterpret_cast<std::ostream*>(static_cast<std::uintptr_t>(1));
+			}
+
+			/// Index of the stream word pointing back to the
+			/// stream, which tells the callback below which
+			/// stream is being destroyed.
+			static int word()
+			{
+				static const int index(std::ios_base::xalloc());
+				return index;
+			}
+
+			/// Release the slot of a stream when it is destroyed, so
+			/// a stream created later at the same address does not
+			/// inherit its settings. copyfmt() also raises erase_event
+			/// before copying the words of another stream, so it resets
+			/// the settings of the stream as well.
+			static void on_event(const std::ios_base::event _event, std::ios_base& _base, const int _index)
+			{
+				void*& owner(_base.pword(_index));
+				if (_event == std::ios_base::erase_event && owner != nullptr)
+				{
+					registry.forget(static_cast<std::ostream*>(owner));
+				}
+				if (_event != std::ios_base::imbue_event)
+				{
+					owner = nullptr;
+				}
+			}
+
+		public:
+
+			/// Find the sink for _os, registering it if necessary.
+			Sink& find(std::ostream* _os)
+			{
+				bool full(true);
+				std::size_t idx(slot(_os));
+				for (std::size_t probe = 0; probe < sinks.size(); ++probe, ++idx)
+				{
+					Sink& sink(sinks[idx & (sinks.size() - 1)]);
+					std::ostream* cur(sink.stream.load(std::memory_order_acquire));
+					if (cur == _os)
+					{
+						return sink;
+					}
+
+					if (cur == nullptr)
+					{
+						full = false;
+						break;
+					}
+
+					full = full && cur != released();
+				}
+				return full ? overflow : enroll(_os);
+			}
+
+			/// Release the slot of _os and reset its state.
+			void forget(std::ostream* _os)
+			{
+				glock lk(mutex);
+				std::size_t idx(slot(_os));
+				for (std::size_t probe = 0; probe < sinks.size(); ++probe, ++idx)
+				{
+					Sink& sink(sinks[idx & (sinks.size() - 1)]);
+					std::ostream* cur(sink.stream.load(std::memory_order_acquire));
+					if (cur == nullptr)
+					{
+						return;
+					}
+
+					if (cur == _os)
+					{
+						{
+							glock slk(sink.mutex);
+							sink.reset();
+						}
+						sink.stream.store(released(), std::memory_order_release);
+						return;
+					}
+				}
+			}
+
+			/// Pass every registered sink to _fn.
+			template<typename Fn>
+			void each(Fn&& _fn)
+			{
+				for (Sink& sink : sinks)
+				{
+					std::ostream* cur(sink.stream.load(std::memory_order_acquire));
+					if (cur != nullptr && cur != released())
+					{
+						_fn(sink);
+					}
+				}
+				_fn(overflow);
+			}
+
+			/// Kind of _os. Streams sharing the overflow
+			/// sink are classified on every call.
+			Kind kind(std::ostream* _os)
+			{
+				Sink& sink(find(_os));
+				return shared(sink) ? classify(_os) : sink.kind.load(std::memory_order_relaxed);
+			}
+
+			/// Indicates whether _sink is shared by
+			/// all streams that did not get a slot.
+			bool shared(const Sink& _sink) const
+			{
+				return std::addressof(_sink) == std::addressof(overflow);
+			}
+
+		private:
+
+			/// Register _os in the first free or released slot
+			/// on its probe sequence. The mutex keeps two threads
+			/// from registering the same stream in different slots.
+			Sink& enroll(std::ostream* _os)
+			{
+				glock lk(mutex);
+				Sink* free(nullptr);
+				std::size_t idx(slot(_os));
+				for (std::size_t probe = 0; probe < sinks.size(); ++probe, ++idx)
+				{
+					Sink& sink(sinks[idx & (sinks.size() - 1)]);
+					std::ostream* cur(sink.stream.load(std::memory_order_acquire));
+					if (cur == _os)
+					{
+						return sink;
+					}
+
+					if (cur == released() && free == nullptr)
+					{
+						free = std::addressof(sink);
+					}
+
+					if (cur == nullptr)
+					{
+						if (free == nullptr)
+						{
+							free = std::addressof(sink);
+						}
+						break;
+					}
+				}
+
+				if (free == nullptr)
+				{
+					return overflow;
+				}
+
+				_os->pword(word()) = _os;
+				_os->register_callback(on_event, word());
+				free->kind.store(classify(_os), std::memory_order_relaxed);
+				free->stream.store(_os, std::memory_order_release);
+				return *free;
+			}
+
+			/// Kind of _os, found out with a dynamic_cast.
+			static Kind classify(const std::ostream* _os)
+			{
+				if (dynamic_cast<const Tee*>(_os) != nullptr)
+				{
+					return Kind::Tee;
+				}
+				if (dynamic_cast<const BinaryFile*>(_os) != nullptr)
+				{
+					return Kind::Binary;
+				}
+				return Kind::Plain;
+			}
+		};
+
+		/// Streams written to so far.
+		static Registry registry;
+
+		/// Write path counters of one thread. Only the owning
+		/// thread updates them, so updates are plain loads
+		/// and stores rather than read-modify-write operations.
+		struct alignas(cache_line) Counters
+		{
+			std::atomic<std::uint64_t> records{0};
+			std::atomic<std::uint64_t> bytes{0};
+			std::atomic<std::uint64_t> lock_wait{0};
+			std::atomic<std::uint64_t> max_lock_wait{0};
+			std::atomic<std::uint64_t> write_time{0};
+
+			static void add(std::atomic<std::uint64_t>& _counter, const std::uint64_t _value)
+			{
+				_counter.store(_counter.load(std::memory_order_relaxed) + _value, std::memory_order_relaxed);
+			}
+
+			void add(const Counters& _other)
+			{
+				add(records, _other.records.load(std::memory_order_relaxed));
+				add(bytes, _other.bytes.load(std::memory_order_relaxed));
+				add(lock_wait, _other.lock_wait.load(std::memory_order_relaxed));
+				add(write_time, _other.write_time.load(std::memory_order_relaxed));
+				max_lock_wait.store(std::max(max_lock_wait.load(std::memory_order_relaxed), _other.max_lock_wait.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+			}
+		};
+
+		/// Per-thread counters of all threads which have
+		/// written to a stream. Counters of threads which
+		/// have exited are folded into a single set.
+		class Meter
+		{
+			std::mutex mutex;
+
+			std::vector<std::shared_ptr<Counters>> shards;
+
+			Counters retired;
+
+			/// Registers the counters of a thread
+			/// and retires them when the thread exits.
+			struct Shard
+			{
+				std::shared_ptr<Counters> counters{std::make_shared<Counters>()};
+
+				Shard()
+				{
+					glock lk(meter.mutex);
+					meter.shards.push_back(counters);
+				}
+
+				~Shard()
+				{
+					gone() = true;
+					glock lk(meter.mutex);
+					meter.retired.add(*counters);
+					meter.shards.erase(std::find(meter.shards.begin(), meter.shards.end(), counters));
+				}
+			};
+
+			static bool& gone()
+			{
+				thread_local bool flag{false};
+				return flag;
+			}
+
+		public:
+
+			/// Counters of the calling thread, or nullptr if
+			/// they have been retired already. This happens when
+			/// a thread-local destructor logs after the shard
+			/// of the thread has been destroyed, in which case
+			/// the output is not counted.
+			static Counters* local()
+			{
+				if (gone())
+				{
+					return nullptr;
+				}
+				thread_local Shard shard;
+				return shard.counters.get();
+			}
+
+			/// Sum of the counters of all threads.
+			void collect(Stats& _stats)
+			{
+				Counters total;
+				{
+					glock lk(mutex);
+					total.add(retired);
+					for (const auto& shard : shards)
+					{
+						total.add(*shard);
+					}
+				}
+				_stats.records = total.records.load(std::memory_order_relaxed);
+				_stats.bytes = total.bytes.load(std::memory_order_relaxed);
+				_stats.lock_wait = total.lock_wait.load(std::memory_order_relaxed);
+				_stats.max_lock_wait = total.max_lock_wait.load(std::memory_order_relaxed);
+				_stats.write_time = total.write_time.load(std::memory_order_relaxed);
+			}
+		};
+
+		/// Counters behind stats().
+		static Meter meter;
+
+		/// Buffers holding on to more memory than this
+		/// release it after an oversized message.
+		static constexpr std::size_t spill_limit{16 * DLOG_BUFFER_SIZE};
+
+		/// Stream buffer which keeps the output in an
+		/// inline array and only moves it to the heap
+		/// if it outgrows the array.
+		class Buffer : public std::streambuf
+		{
+			std::array<char, DLOG_BUFFER_SIZE> local;
+
+			std::unique_ptr<char[]> heap{nullptr};
+
+		public:
+
+			Buffer()
+			{
+				setp(local.data(), local.data() + local.size());
+			}
+
+			Buffer(const Buffer&) = delete;
+
+			Buffer& operator = (const Buffer&) = delete;
+
+			/// The output written so far.
+			std::string_view view() const
+			{
+				return {pbase(), static_cast<std::size_t>(pptr() - pbase())};
+			}
+
+			/// Discard the output after the first _size characters.
+			void truncate(const std::size_t _size)
+			{
+				setp(pbase(), epptr());
+				pbump(static_cast<int>(_size));
+			}
+
+			/// Append raw characters, bypassing the stream.
+			void append(const char* _str, const std::size_t _count)
+			{
+				if (static_cast<std::size_t>(epptr() - pptr()) < _count)
+				{
+					grow(_count);
+				}
+				std::memcpy(pptr(), _str, _count);
+				pbump(static_cast<int>(_count));
+			}
+
+			/// Discard the output, keeping the heap
+			/// storage unless it has grown too large.
+			void clear()
+			{
+				if (heap && static_cast<std::size_t>(epptr() - pbase()) > spill_limit)
+				{
+					heap.reset();
+					setp(local.data(), local.data() + local.size());
+					return;
+				}
+				setp(pbase(), epptr());
+			}
+
+		protected:
+
+			int_type overflow(int_type _ch) override
+			{
+				if (traits_type::eq_int_type(_ch, traits_type::eof()))
+				{
+					return traits_type::not_eof(_ch);
+				}
+
+				grow(1);
+				*pptr() = traits_type::to_char_type(_ch);
+				pbump(1);
+				return _ch;
+			}
+
+			std::streamsize xsputn(const char* _str, std::streamsize _count) override
+			{
+				if (epptr() - pptr() < _count)
+				{
+					grow(static_cast<std::size_t>(_count));
+				}
+				std::memcpy(pptr(), _str, static_cast<std::size_t>(_count));
+				pbump(static_cast<int>(_count));
+				return _count;
+			}
+
+		private:
+
+			void grow(const std::size_t _extra)
+			{
+				const std::size_t used(static_cast<std::size_t>(pptr() - pbase()));
+				const std::size_t size(std::max(2 * static_cast<std::size_t>(epptr() - pbase()), used + _extra));
+				std::unique_ptr<char[]> mem(new char[size]);
+				std::memcpy(mem.get(), pbase(), used);
+				heap = std::move(mem);
+				setp(heap.get(), heap.get() + size);
+				pbump(static_cast<int>(used));
+			}
+		};
+
+		/// Buffer and the stream writing to it.
+		struct Scratch
+		{
+			/// Format flags of a freshly reset stream.
+			static constexpr std::ios_base::fmtflags default_flags{std::ios_base::skipws | std::ios_base::dec};
+
+			Buffer storage;
+
+			std::ostream stream{&storage};
+
+			/// Set if the locale of the stream prints numbers
+			/// without digit grouping and with '.' as the decimal
+			/// point, in which case numbers written with the
+			/// default flags can bypass the stream.
+			const bool plain{std::use_facet<std::numpunct<char>>(stream.getloc()).grouping().empty() &&
+							 std::use_facet<std::numpunct<char>>(stream.getloc()).decimal_point() == '.'};
+
+			/// Indicates whether output can bypass the stream,
+			/// i.e. the stream uses the default format.
+			bool direct() const
+			{
+				return plain && stream.flags() == default_flags && stream.width() == 0 && stream.precision() == 6;
+			}
+
+			/// Prepare the scratch for the next message.
+			void reset()
+			{
+				storage.clear();
+				stream.clear();
+				stream.flags(default_flags);
+				stream.fill(' ');
+				stream.width(0);
+				stream.precision(6);
+			}
+		};
+
+		/// Thread-local pool of scratch buffers.
+		/// Each dlog borrows a scratch buffer when it is
+		/// created and returns it when it is destroyed,
+		/// so buffers keep the memory they have grown into
+		/// and logging does not allocate in the steady state.
+		class Pool
+		{
+			std::vector<std::unique_ptr<Scratch>> free;
+
+		public:
+
+			~Pool()
+			{
+				gone() = true;
+			}
+
+			static Scratch* borrow()
+			{
+				if (!gone())
+				{
+					auto& free(local().free);
+					if (!free.empty())
+					{
+						Scratch* scratch(free.back().release());
+						free.pop_back();
+						return scratch;
+					}
+				}
+				return new Scratch;
+			}
+
+			static void give_back(Scratch* _scratch)
+			{
+				if (gone())
+				{
+					/// Logging from a thread-local destructor
+					/// after the pool has been destroyed.
+					delete _scratch;
+					return;
+				}
+				_scratch->reset();
+				local().free.emplace_back(_scratch);
+			}
+
+		private:
+
+			static Pool& local()
+			{
+				thread_local Pool pool;
+				return pool;
+			}
+
+			static bool& gone()
+			{
+				thread_local bool flag{false};
+				return flag;
+			}
+		};
+
+		/// Layout of a message and the values
+		/// captured when it was logged.
+		struct Stamp
+		{
+			std::shared_ptr<const Layout> layout{nullptr};
+			Layout::Fields fields;
+		};
+
+		/// A finished log entry waiting to be printed.
+		struct Record
+		{
+			/// Destination stream.
+			std::ostream* stream{nullptr};
+
+			/// Keeps file streams alive until
+			/// the record has been printed.
+			std::shared_ptr<std::ostream> ofs{nullptr};
+
+			/// Format of a deferred message, in which case
+			/// the content holds the encoded arguments.
+			const Format* format{nullptr};
+
+			/// Fully formatted output or encoded message.
+			std::string content;
+
+			/// Layout rendered in front of the content.
+			Stamp stamp;
+
+			uint log_level{0};
+		};
+
+		/// Lock-free single-producer / single-consumer ring
+		/// holding finished records. Every thread that logs
+		/// in async mode owns one ring, and the printer thread
+		/// is the only consumer of all rings. Each cell carries
+		/// a sequence number telling whether it is free or holds
+		/// a record, and records are claimed by advancing the
+		/// head with a CAS, so the producer can also discard
+		/// the oldest record when the ring is full.
+		class Ring
+		{
+			struct Cell
+			{
+				/// Equal to the position of the cell when it is
+				/// free and one past the position when it holds
+				/// a record.
+				std::atomic<std::size_t> seq{0};
+
+				Record rec;
+			};
+
+			/// Next record to be printed or discarded.
+			alignas(cache_line) std::atomic<std::size_t> head{0};
+
+			/// Producer position.
+			alignas(cache_line) std::atomic<std::size_t> tail{0};
+
+			/// Set while the owning thread hands over a record.
+			std::atomic<bool> busy{false};
+
+			alignas(cache_line) std::unique_ptr<Cell[]> cells{new Cell[capacity]};
+
+			/// Set when the owning thread exits.
+			std::atomic<bool> closed{false};
+
+		public:
+
+			static constexpr std::size_t capacity{DLOG_RING_CAPACITY};
+
+			static_assert((capacity & (capacity - 1)) == 0, "DLOG_RING_CAPACITY must be a power of two");
+
+			Ring()
+			{
+				for (std::size_t i = 0; i < capacity; ++i)
+				{
+					cells[i].seq.store(i, std::memory_order_relaxed);
+				}
+			}
+
+			/// Producer side. Returns false if the ring is full.
+			/// The content is copied into the string kept in the
+			/// slot, which reuses its capacity from earlier records.
+			bool push(std::ostream* _stream, const std::shared_ptr<std::ostream>& _ofs, const std::string_view _content, const Format* _format, const Stamp* _stamp, const uint _level)
+			{
+				const std::size_t t(tail.load(std::memory_order_relaxed));
+				Cell& cell(cells[t & (capacity - 1)]);
+				if (cell.seq.load(std::memory_order_acquire) != t)
+				{
+					return false;
+				}
+				Record& rec(cell.rec);
+				rec.stream = _stream;
+				rec.ofs = _ofs;
+				rec.format = _format;
+				rec.content.assign(_content);
+				rec.log_level = _level;
+				if (_stamp != nullptr)
+				{
+					rec.stamp = *_stamp;
+				}
+				cell.seq.store(t + 1, std::memory_order_release);
+				tail.store(t + 1, std::memory_order_release);
+				return true;
+			}
+
+			/// Producer side. The stream of the oldest record if
+			/// the ring is full and the printer has not claimed
+			/// the record yet, otherwise nullptr.
+			std::ostream* oldest() const
+			{
+				const std::size_t h(head.load(std::memory_order_acquire));
+				const Cell& cell(cells[h & (capacity - 1)]);
+				if (tail.load(std::memory_order_relaxed) - h != capacity ||
+					cell.seq.load(std::memory_order_acquire) != h + 1)
+				{
+					return nullptr;
+				}
+				return cell.rec.stream;
+			}
+
+			/// Producer side. Discard the oldest record, which makes
+			/// room for a new one. Returns false if the printer has
+			/// claimed the record in the meantime.
+			bool evict()
+			{
+				std::size_t h(head.load(std::memory_order_acquire));
+				if (tail.load(std::memory_order_relaxed) - h != capacity ||
+					!head.compare_exchange_strong(h, h + 1, std::memory_order_acq_rel))
+				{
+					return false;
+				}
+				release(cells[h & (capacity - 1)], h);
+				return true;
+			}
+
+			/// Consumer side. Passes the records pushed so far
+			/// to _fn and returns the number of records consumed.
+			template<typename Fn>
+			std::size_t consume(Fn&& _fn)
+			{
+				const std::size_t end(tail.load(std::memory_order_acquire));
+				std::size_t count(0);
+				std::size_t h(head.load(std::memory_order_acquire));
+				while (h < end)
+				{
+					Cell& cell(cells[h & (capacity - 1)]);
+					if (!head.compare_exchange_weak(h, h + 1, std::memory_order_acq_rel))
+					{
+						/// Either a spurious failure or the producer has
+						/// discarded the record; h now holds the new head.
+						continue;
+					}
+					_fn(cell.rec);
+					release(cell, h);
+					++count;
+					++h;
+				}
+				return count;
+			}
+
+			/// Producer side. Mark the start and the end of
+			/// a hand-over, which the printer waits for when
+			/// it stops. The start is sequentially consistent
+			/// with the check of the running flag that follows.
+			void enter()
+			{
+				busy.store(true, std::memory_order_seq_cst);
+			}
+
+			void leave()
+			{
+				busy.store(false, std::memory_order_release);
+			}
+
+			/// Indicates whether the owning thread is handing over a record.
+			bool entered() const
+			{
+				return busy.load(std::memory_order_acquire);
+			}
+
+			/// Position of the last record pushed so far.
+			std::size_t mark() const
+			{
+				return tail.load(std::memory_order_acquire);
+			}
+
+			/// Indicates whether all records up to _mark have been consumed.
+			bool reached(const std::size_t _mark) const
+			{
+				return head.load(std::memory_order_acquire) >= _mark;
+			}
+
+			bool empty() const
+			{
+				return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+			}
+
+			void close()
+			{
+				closed.store(true, std::memory_order_release);
+			}
+
+			bool is_closed() const
+			{
+				return closed.load(std::memory_order_acquire);
+			}
+
+		private:
+
+			/// Clear the record in _cell and hand the cell
+			/// back to the producer for position _pos + capacity.
+			static void release(Cell& _cell, const std::size_t _pos)
+			{
+				Record& rec(_cell.rec);
+				rec.ofs.reset();
+				rec.stamp.layout.reset();
+				if (rec.content.capacity() > spill_limit)
+				{
+					std::string().swap(rec.content);
+				}
+				_cell.seq.store(_pos + capacity, std::memory_order_release);
+			}
+		};
+
+		/// Background printer used in async mode.
+		/// Records are handed over by the destructor
+		/// and written to their streams by a single
+		/// thread which owns all output operations.
+		struct Printer
+		{
+			/// Serialises starting and stopping the thread.
+			std::mutex control;
+
+			/// Protects the ring lists and the sleep handshake.
+			std::mutex mutex;
+
+			/// Signalled when new records arrive.
+			std::condition_variable wake;
+
+			/// Rings of threads that started logging
+			/// since the last pass of the printer.
+			std::vector<std::shared_ptr<Ring>> joining;
+
+			/// Rings drained by the printer. Only the printer
+			/// thread modifies this list (under the mutex).
+			std::vector<std::shared_ptr<Ring>> rings;
+
+			/// Streams written to during the current pass,
+			/// flushed at the end of the pass.
+			std::vector<std::pair<std::ostream*, std::shared_ptr<std::ostream>>> touched;
+
+			/// Sinks of streams with a note about repeated
+			/// records which was not due at the end of a pass.
+			/// While there are any, the printer wakes up once
+			/// a second to write them.
+			std::vector<Sink*> lingering;
+
+			/// Sinks of streams with dropped records which
+			/// have not been reported yet, revisited like
+			/// the lingering repeat notes.
+			std::vector<Sink*> dropping;
+
+			/// Set by producers when they drop a record, so the
+			/// printer looks for streams with drops to report.
+			std::atomic<bool> dropped{false};
+
+			/// Requests by drain() to report all drops right away
+			/// and the last request served by a pass of the printer.
+			std::atomic<std::uint64_t> requests{0};
+			std::atomic<std::uint64_t> served{0};
+
+			/// Number of passes over the rings started and finished.
+			std::atomic<std::uint64_t> started{0};
+			std::atomic<std::uint64_t> finished{0};
+
+			std::thread thread;
+
+			std::atomic<bool> running{false};
+
+			/// Set while the printer waits for new records.
+			std::atomic<bool> sleeping{false};
+
+			/// Also writes the notes about repeated records still
+			/// pending at exit, which in sync mode nothing else does.
+			~Printer()
+			{
+				stop();
+				settle();
+			}
+
+			void start()
+			{
+				glock ctl(control);
+				if (thread.joinable())
+				{
+					return;
+				}
+
+				running.store(true, std::memory_order_release);
+				thread = std::thread([this]{ run(); });
+			}
+
+			void stop()
+			{
+				glock ctl(control);
+				if (!thread.joinable())
+				{
+					return;
+				}
+
+				{
+					glock lk(mutex);
+					running.store(false, std::memory_order_seq_cst);
+				}
+				wake.notify_one();
+				thread.join();
+
+				/// Producers which saw the printer running may
+				/// still be handing over records. Any thread that
+				/// attaches its ring from here on sees it stopped.
+				collect();
+				for (const auto& ring : rings)
+				{
+					while (ring->entered())
+					{
+						std::this_thread::yield();
+					}
+				}
+
+				/// Print anything that slipped in
+				/// while the printer was shutting down.
+				print(true);
+			}
+
+			/// Register the ring of a thread which
+			/// has started logging in async mode.
+			void attach(std::shared_ptr<Ring> _ring)
+			{
+				glock lk(mutex);
+				joining.push_back(std::move(_ring));
+			}
+
+			/// Hand a record over to the printer thread.
+			/// Returns false if the printer is not running,
+			/// in which case the caller prints the record itself.
+			/// If the ring is full, the backpressure policy of
+			/// the stream decides whether to wait or to drop
+			/// a record.
+			bool push(std::ostream* _stream, const std::shared_ptr<std::ostream>& _ofs, const std::string_view _content, const Format* _format, const Stamp* _stamp, const uint _level)
+			{
+				if (!running.load(std::memory_order_acquire))
+				{
+					return false;
+				}
+
+				/// Once the ring of the thread is gone,
+				/// the caller writes the record itself.
+				Ring* ring(local_ring());
+				if (ring == nullptr)
+				{
+					return false;
+				}
+
+				/// stop() clears the running flag before it waits for
+				/// rings in the middle of a hand-over, so either it
+				/// waits for this one or the check below fails.
+				ring->enter();
+				const bool handed(running.load(std::memory_order_seq_cst) &&
+								  hand_over(*ring, _stream, _ofs, _content, _format, _stamp, _level));
+				ring->leave();
+				return handed;
+			}
+
+			/// Block until all records handed over
+			/// so far have been printed.
+			void drain()
+			{
+				std::vector<std::pair<std::shared_ptr<Ring>, std::size_t>> marks;
+				{
+					glock lk(mutex);
+					for (const auto& ring : rings)
+					{
+						marks.emplace_back(ring, ring->mark());
+					}
+					for (const auto& ring : joining)
+					{
+						marks.emplace_back(ring, ring->mark());
+					}
+				}
+
+				for (const auto& [ring, mark] : marks)
+				{
+					while (!ring->reached(mark) && running.load(std::memory_order_acquire))
+					{
+						notify();
+						std::this_thread::sleep_for(std::chrono::microseconds(50));
+					}
+				}
+
+				/// Wait for the pass which printed the last
+				/// record to finish flushing the streams.
+				const std::uint64_t pass(started.load(std::memory_order_acquire));
+				while (finished.load(std::memory_order_acquire) < pass && running.load(std::memory_order_acquire))
+				{
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+				}
+
+				/// Have the printer report the records dropped so far,
+				/// without waiting for the usual second between notes.
+				const std::uint64_t request(requests.fetch_add(1, std::memory_order_acq_rel) + 1);
+				notify();
+				while (served.load(std::memory_order_acquire) < request && running.load(std::memory_order_acquire))
+				{
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+				}
+
+				/// If the printer is being stopped,
+				/// stop() prints the rest before it returns.
+				if (!running.load(std::memory_order_acquire))
+				{
+					glock ctl(control);
+				}
+			}
+
+			/// Wait until the records handed over by the calling
+			/// thread have been printed, so a record it writes
+			/// itself (for instance because async mode has just
+			/// been switched off) cannot overtake them. Either the
+			/// printer is still running or stop() prints them.
+			/// A record leaves the ring before it is written, so
+			/// the pass which took it has to finish as well.
+			void catch_up()
+			{
+				const Ring* ring(current());
+				if (ring == nullptr)
+				{
+					return;
+				}
+
+				for (uint round = 0; !ring->empty(); ++round)
+				{
+					nudge();
+					pause(round);
+				}
+
+				const std::uint64_t pass(started.load(std::memory_order_acquire));
+				for (uint round = 0; finished.load(std::memory_order_acquire) < pass; ++round)
+				{
+					pause(round);
+				}
+			}
+
+		private:
+
+			/// Push a record to the ring of the calling thread,
+			/// applying the backpressure policy if it is full.
+			/// Returns false if the printer stops in the meantime.
+			bool hand_over(Ring& _ring, std::ostream* _stream, const std::shared_ptr<std::ostream>& _ofs, const std::string_view _content, const Format* _format, const Stamp* _stamp, const uint _level)
+			{
+				if (!_ring.push(_stream, _ofs, _content, _format, _stamp, _level))
+				{
+					Sink& sink(registry.find(_stream));
+					const Backpressure policy(sink.backpressure.load(std::memory_order_relaxed));
+					const bool drops(policy == Backpressure::DropNewest ||
+									 policy == Backpressure::DropOldest ||
+									 (policy == Backpressure::Shed && _level < sink.shed_level.load(std::memory_order_relaxed)));
+
+					for (uint round = 0; !_ring.push(_stream, _ofs, _content, _format, _stamp, _level); ++round)
+					{
+						if (!running.load(std::memory_order_acquire))
+						{
+							return false;
+						}
+
+						if (drops)
+						{
+							/// With DropOldest, discard the oldest record unless
+							/// its stream blocks or the printer is busy with it.
+							std::ostream* victim(policy == Backpressure::DropOldest ? _ring.oldest() : nullptr);
+							Sink* victim_sink(victim != nullptr ? std::addressof(registry.find(victim)) : nullptr);
+							if (victim_sink == nullptr ||
+								victim_sink->backpressure.load(std::memory_order_relaxed) == Backpressure::Block)
+							{
+								sink.dropped.fetch_add(1, std::memory_order_relaxed);
+								dropped.store(true, std::memory_order_release);
+								nudge();
+								return true;
+							}
+							if (_ring.evict())
+							{
+								victim_sink->dropped.fetch_add(1, std::memory_order_relaxed);
+								dropped.store(true, std::memory_order_release);
+							}
+							continue;
+						}
+
+						/// Wait for the printer to catch up.
+						nudge();
+						pause(round);
+					}
+				}
+
+				nudge();
+				return true;
+			}
+
+			/// The ring owned by the calling thread.
+			/// The ring is closed when the thread exits
+			/// and discarded by the printer once it is empty.
+			/// Returns nullptr if a thread-local destructor
+			/// logs after the ring has been closed.
+			Ring* local_ring()
+			{
+				struct Owner
+				{
+					std::shared_ptr<Ring> ring{std::make_shared<Ring>()};
+
+					~Owner()
+					{
+						gone() = true;
+						current() = nullptr;
+						ring->close();
+					}
+				};
+
+				if (gone())
+				{
+					return nullptr;
+				}
+
+				thread_local Owner owner;
+				if (current() == nullptr)
+				{
+					attach(owner.ring);
+					current() = owner.ring.get();
+				}
+				return current();
+			}
+
+			static bool& gone()
+			{
+				thread_local bool flag{false};
+				return flag;
+			}
+
+			/// The ring of the calling thread if it has one.
+			static Ring*& current()
+			{
+				thread_local Ring* ring{nullptr};
+				return ring;
+			}
+
+			void notify()
+			{
+				{
+					glock lk(mutex);
+					sleeping.store(false, std::memory_order_relaxed);
+				}
+				wake.notify_one();
+			}
+
+			/// Wake the printer if it is waiting for records,
+			/// so producers only lock the mutex when they must.
+			void nudge()
+			{
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (sleeping.load(std::memory_order_relaxed))
+				{
+					notify();
+				}
+			}
+
+			/// Back off while waiting for room in a full ring:
+			/// yield for the first rounds, then sleep for a time
+			/// doubling up to 64 microseconds.
+			static void pause(const uint _round)
+			{
+				constexpr uint spins{16};
+				if (_round < spins)
+				{
+					std::this_thread::yield();
+					return;
+				}
+				std::this_thread::sleep_for(std::chrono::microseconds(1u << std::min(_round - spins, 6u)));
+			}
+
+			/// Pick up new rings and discard those
+			/// whose threads have exited.
+			void collect()
+			{
+				glock lk(mutex);
+				rings.insert(rings.end(), joining.begin(), joining.end());
+				joining.clear();
+				rings.erase(std::remove_if(rings.begin(), rings.end(), [](const auto& _ring)
+				{
+					return _ring->is_closed() && _ring->empty();
+				}), rings.end());
+			}
+
+			/// Print the records in all rings. At the end of the
+			/// pass, notes about records dropped since the last
+			/// note are written, whether or not anything else was
+			/// printed to their streams. Then the streams written
+			/// to are flushed, after notes about repeated records.
+			/// Notes are written at most once a second, unless
+			/// _final is set or drain() asks for them. Streams
+			/// with a note still pending are revisited at the
+			/// end of later passes.
+			std::size_t print(const bool _final = false)
+			{
+				started.fetch_add(1, std::memory_order_acq_rel);
+				std::size_t printed(0);
+				for (const auto& ring : rings)
+				{
+					printed += ring->consume([&](Record& _rec)
+					{
+						write(*_rec.stream, _rec.content, _rec.format, &_rec.stamp, _rec.log_level);
+						if (touched.empty() || touched.back().first != _rec.stream)
+						{
+							touched.emplace_back(_rec.stream, _rec.ofs);
+						}
+					});
+				}
+
+				/// Flush each stream once per pass, so batching
+				/// streams submit everything printed in one go.
+				const std::uint64_t request(requests.load(std::memory_order_acquire));
+				const bool urgent(_final || request != served.load(std::memory_order_relaxed));
+				if (dropped.exchange(false, std::memory_order_acquire) || urgent)
+				{
+					registry.each([&](Sink& _sink)
+					{
+						if (_sink.dropped.load(std::memory_order_relaxed) != _sink.reported && !registry.shared(_sink))
+						{
+							dropping.push_back(std::addressof(_sink));
+						}
+					});
+				}
+				std::sort(dropping.begin(), dropping.end());
+				dropping.erase(std::unique(dropping.begin(), dropping.end()), dropping.end());
+				dropping.erase(std::remove_if(dropping.begin(), dropping.end(), [&](Sink* _sink)
+				{
+					return !report(*_sink, urgent);
+				}), dropping.end());
+
+				std::sort(touched.begin(), touched.end(), [](const auto& _lhs, const auto& _rhs)
+				{
+					return _lhs.first < _rhs.first;
+				});
+				for (std::size_t i = 0; i < touched.size(); ++i)
+				{
+					if (i == 0 || touched[i].first != touched[i - 1].first)
+					{
+						sync(*touched[i].first, _final, &lingering);
+					}
+				}
+				touched.clear();
+
+				std::sort(lingering.begin(), lingering.end());
+				lingering.erase(std::unique(lingering.begin(), lingering.end()), lingering.end());
+				lingering.erase(std::remove_if(lingering.begin(), lingering.end(), [&](Sink* _sink)
+				{
+					return !settle(*_sink, _final);
+				}), lingering.end());
+				served.store(request, std::memory_order_release);
+				finished.fetch_add(1, std::memory_order_acq_rel);
+				return printed;
+			}
+
+			/// Write the note about records dropped on the stream
+			/// of _sink since the last note, and mark the stream
+			/// to be flushed. Returns true if the note is not due
+			/// yet. The stream of a sink with drops is registered,
+			/// since releasing the slot clears them.
+			bool report(Sink& _sink, const bool _final)
+			{
+				const std::uint64_t count(_sink.dropped.load(std::memory_order_relaxed));
+				if (count == _sink.reported)
+				{
+					return false;
+				}
+
+				const std::chrono::steady_clock::time_point now(std::chrono::steady_clock::now());
+				if (!_final && now - _sink.reported_at < std::chrono::seconds(1))
+				{
+					return true;
+				}
+
+				std::ostream* stream(_sink.stream.load(std::memory_order_acquire));
+				const std::string note(notice(_sink, std::to_string(count - _sink.reported) + " messages dropped"));
+				write(*stream, note, nullptr);
+				touched.emplace_back(stream, nullptr);
+				_sink.reported = count;
+				_sink.reported_at = now;
+				return false;
+			}
+
+			bool pending()
+			{
+				if (!joining.empty() || requests.load(std::memory_order_relaxed) != served.load(std::memory_order_relaxed))
+				{
+					return true;
+				}
+				for (const auto& ring : rings)
+				{
+					if (!ring->empty())
+					{
+						return true;
+					}
+				}
+				return false;
+			}
+
+			void run()
+			{
+				while (true)
+				{
+					collect();
+					if (print() > 0)
+					{
+						continue;
+					}
+
+					ulock lk(mutex);
+					sleeping.store(true, std::memory_order_relaxed);
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+					if (pending())
+					{
+						sleeping.store(false, std::memory_order_relaxed);
+						continue;
+					}
+
+					if (!running.load(std::memory_order_acquire))
+					{
+						sleeping.store(false, std::memory_order_relaxed);
+						break;
+					}
+
+					if (lingering.empty() && dropping.empty())
+					{
+						wake.wait(lk);
+					}
+					else
+					{
+						wake.wait_for(lk, std::chrono::seconds(1));
+					}
+					sleeping.store(false, std::memory_order_relaxed);
+				}
+			}
+		};
+
+		/// Indicates whether output is handed
+		/// over to the printer thread.
+		inline static std::atomic<bool> async{false};
+
+		/// The printer used in async mode.
+		static Printer printer;
+
+		bool out{true};
+
+		/// Strings appended to the input.
+		/// If not set in the constructor, these
+		/// are given the default values.
+		AffixSet afx;
+
+		std::shared_ptr<std::ostream> ofs{nullptr};
+
+		/// Stream associated with this log.
+		std::ostream& stream{std::cout};
+
+		/// Encoding of the stream, looked up once per message.
+		const Encoding encoding{out ? encoding_of(stream) : Encoding::Text};
+
+		/// Scratch buffer borrowed from the thread-local pool.
+		Scratch* scratch{Pool::borrow()};
+
+		/// Stream writing to the scratch buffer.
+		std::ostream& buffer{scratch->stream};
+
+		/// Encoded fields of a message for a stream with
+		/// a structured encoding. Borrowed on the first field.
+		Scratch* fields{nullptr};
+
+		/// Decayed type of the first argument (void if there is none).
+		template<typename ... Args>
+		using first_t = std::decay_t<std::tuple_element_t<0, std::tuple<Args..., void>>>;
+
+		/// Indicates whether the first argument selects the stream.
+		template<typename ... Args>
+		static constexpr bool selects_stream()
+		{
+			using First = first_t<Args...>;
+			return std::is_base_of_v<std::ostream, First> || is_shared_stream<First>;
+		}
+
+		/// Indicates whether the first argument selects the stream
+		/// or the affixes, in which case it is not part of the output.
+		/// This keeps streams derived from std::ostream from being
+		/// picked up as output by the catch-all constructor.
+		template<typename ... Args>
+		static constexpr bool selects_target()
+		{
+			return selects_stream<Args...>() || std::is_same_v<first_t<Args...>, AffixSet>;
+		}
+
+	public:
+
+		template<typename Arg, typename ... Args>
+		dlog(std::ostream& _stream, AffixSet _afx, Arg&& _arg, Args&& ... _args)
+			:
+			  out(passes(_afx.log_level, _stream)),
+			  afx(std::move(_afx)),
+			  stream(_stream)
+		{
+			init(std::forward<Arg>(_arg), std::forward<Args>(_args)...);
+		}
+
+		template<typename Stream, typename ... Args, typename = std::enable_if_t<std::is_base_of_v<std::ostream, Stream>>>
+		dlog(std::shared_ptr<Stream> _stream, Args&& ... _args)
+			:
+			  dlog(static_cast<std::ostream&>(*_stream), std::forward<Args>(_args)...)
+		{
+			ofs = std::move(_stream);
+		}
+
+		template<typename ... Args>
+		dlog(std::ostream& _stream, Args&& ... _args)
+			:
+			  stream(_stream)
+		{
+			init(std::forward<Args>(_args)...);
+		}
+
+		template<typename ... Args>
+		dlog(AffixSet _afx, Args&& ... _args)
+			:
+			  out(passes(_afx.log_level, std::cout)),
+			  afx(std::move(_afx))
+		{
+			init(std::forward<Args>(_args)...);
+		}
+
+		template<typename ... Args, typename = std::enable_if_t<!selects_target<Args...>()>>
+		dlog(Args&& ... _args)
+		{
+			init(std::forward<Args>(_args)...);
+		}
+
+		~dlog()
+		{
+			if (out && encoding != Encoding::Text)
+			{
+				submit_record();
+			}
+			else if (out)
+			{
+				text(afx.suffix);
+				if (afx.layout)
+				{
+					const Stamp stamp(make_stamp(afx));
+					submit(stream, ofs, scratch->storage.view(), afx.log_level, nullptr, &stamp);
+				}
+				else
+				{
+					submit(stream, ofs, scratch->storage.view(), afx.log_level);
+				}
+			}
+			Pool::give_back(scratch);
+			if (fields != nullptr)
+			{
+				Pool::give_back(fields);
+			}
+		}
+
+		dlog(const dlog&) = delete;
+
+		dlog& operator = (const dlog&) = delete;
+
+		template<typename T>
+		friend dlog& operator << (dlog& _dlog, T&& _t)
+		{
+			_dlog.gobble(std::forward<T>(_t));
+			return _dlog;
+		}
+
+		friend dlog& operator << (dlog& _dlog, std::ostream& (*_fp)(std::ostream&))
+		{
+			if (_dlog.out)
+			{
+				_dlog.buffer << _fp;
+			}
+			return _dlog;
+		}
+
+		///=====================================
+		/// Other convenience functions.
+		///=====================================
+
+		template<typename T>
+		dlog& add(T&& _t)
+		{
+			if (out)
+			{
+				put(std::forward<T>(_t));
+			}
+			return *this;
+		}
+
+		template<typename T>
+		dlog& operator + (T&& _t)
+		{
+			add(std::forward<T>(_t));
+			return *this;
+		}
+
+		template<typename T>
+		dlog& format(T&& _t, const uint _width)
+		{
+			if (out)
+			{
+				buffer << std::setw(_width);
+				put(std::forward<T>(_t));
+			}
+			return *this;
+		}
+
+		/// Write a floating-point number with _precision
+		/// digits after the decimal point.
+		template<typename T>
+		dlog& fixed(const T _t, const int _precision)
+		{
+			if (out)
+			{
+				put(Async::fixed(_t, _precision));
+			}
+			return *this;
+		}
+
+		/// Write a floating-point number in scientific
+		/// notation with _precision digits after the
+		/// decimal point.
+		template<typename T>
+		dlog& scientific(const T _t, const int _precision)
+		{
+			if (out)
+			{
+				put(Async::scientific(_t, _precision));
+			}
+			return *this;
+		}
+
+		/// Report the number of messages suppressed by a
+		/// rate-limited call site as a field (if there are any).
+		dlog& suppressed(const std::uint64_t _count)
+		{
+			if (out && _count > 0)
+			{
+				next(kv("suppressed", _count));
+			}
+			return *this;
+		}
+
+		///=====================================
+		/// Output formatting
+		///=====================================
+
+		inline dlog& left()
+		{
+			if (out)
+			{
+				buffer << std::left;
+			}
+			return *this;
+		}
+
+		inline dlog& internal()
+		{
+			if (out)
+			{
+				buffer << std::internal;
+			}
+			return *this;
+		}
+
+		inline dlog& right()
+		{
+			if (out)
+			{
+				buffer << std::right;
+			}
+			return *this;
+		}
+
+		inline dlog& setfill(const char _ch = ' ')
+		{
+			if (out)
+			{
+				buffer << std::setfill(_ch);
+			}
+			return *this;
+		}
+
+		///=====================================
+		/// Static functions.
+		///=====================================
+
+		static void set_log_level(const uint _level)
+		{
+			log_level.level.store(_level, std::memory_order_relaxed);
+		}
+
+		/// Set the log level of a single stream.
+		/// Messages written to _stream must pass both
+		/// this and the global log level, so a stream
+		/// can be made quieter than the rest.
+		///
+		/// This and the other settings of single streams
+		/// are kept until the stream is destroyed (or
+		/// forgotten, see forget()). They return false if
+		/// the stream had to share its slot in the registry
+		/// with other streams because more than
+		/// DLOG_MAX_STREAMS streams are in use.
+		static bool set_log_level(std::ostream& _stream, const uint _level)
+		{
+			Sink& sink(registry.find(std::addressof(_stream)));
+			if (registry.shared(sink))
+			{
+				return false;
+			}
+			sink.log_level.store(_level, std::memory_order_relaxed);
+			log_level.per_stream.store(true, std::memory_order_relaxed);
+			return true;
+		}
+
+		/// Set what happens to records for _stream in async mode
+		/// when the ring of the logging thread is full. With
+		/// Backpressure::Shed, records below _level are dropped
+		/// and the others wait. Dropped records are counted (see
+		/// stats()), and the printer writes a note with the number
+		/// of records dropped to the stream at most once a second.
+		static bool set_backpressure(std::ostream& _stream, const Backpressure _policy, const uint _level = 0)
+		{
+			Sink& sink(registry.find(std::addressof(_stream)));
+			if (registry.shared(sink))
+			{
+				return false;
+			}
+			sink.shed_level.store(_level, std::memory_order_relaxed);
+			sink.backpressure.store(_policy, std::memory_order_relaxed);
+			return true;
+		}
+
+		/// Set how messages written to _stream are encoded.
+		/// With Encoding::Json each message is written as a JSON
+		/// object on a line of its own, and with Encoding::Logfmt
+		/// as a line of key=value pairs. The record holds the time
+		/// (if the affixes have a layout), the log level (unless it
+		/// is 0), the other arguments joined with the infix as "msg",
+		/// and the fields logged with kv(). The prefix, suffix and
+		/// layout are not printed. Text which reaches the stream
+		/// without being encoded for it, such as a deferred message
+		/// or a message written through a tee, is written as a record
+		/// holding the log level and the whole line as "msg".
+		static bool set_encoding(std::ostream& _stream, const Encoding _encoding)
+		{
+			Sink& sink(registry.find(std::addressof(_stream)));
+			if (registry.shared(sink))
+			{
+				return false;
+			}
+			sink.encoding.store(_encoding, std::memory_order_relaxed);
+			log_level.encoded.store(true, std::memory_order_relaxed);
+			return true;
+		}
+
+		/// Collapse runs of identical records written to _stream
+		/// into the first record and a note saying how many times
+		/// it was repeated. The note is written when a different
+		/// record arrives, at most once a second while the run
+		/// lasts, by drain() and set_async(false), and at exit.
+		/// In async mode the printer also writes it about a second
+		/// after the run ends. The layout is not compared, so
+		/// records which only differ in their time still count
+		/// as identical. The check
+		/// is made when the record is written (on the printer thread
+		/// in async mode). Records in binary logs are not collapsed,
+		/// and for a tee, collapsing is set on its streams.
+		static bool set_collapse(std::ostream& _stream, const bool _collapse = true)
+		{
+			Sink& sink(registry.find(std::addressof(_stream)));
+			if (registry.shared(sink))
+			{
+				return false;
+			}
+			sink.collapse.store(_collapse, std::memory_order_relaxed);
+			return true;
+		}
+
+		/// Drop the settings and counters of _stream and release
+		/// its slot in the registry. This happens by itself when
+		/// a stream is destroyed, so it is only needed to start
+		/// afresh with a stream which is still in use. It must
+		/// not be called while messages to _stream are pending.
+		static void forget(std::ostream& _stream)
+		{
+			registry.forget(std::addressof(_stream));
+		}
+
+		/// Indicates whether messages at log level _level
+		/// pass the current log level. Checking this before
+		/// creating a dlog object avoids evaluating the
+		/// arguments of messages which would not be printed.
+		template<typename Level>
+		static bool active(const Level _level)
+		{
+			const uint level(static_cast<uint>(_level));
+			return level == 0 || level >= log_level.level.load(std::memory_order_relaxed);
+		}
+
+		/// Indicates whether messages at log level _level
+		/// pass the compile-time threshold (DLOG_MIN_LEVEL).
+		/// The level can be any integral or enum value.
+		template<auto level>
+		static constexpr bool enabled()
+		{
+			return static_cast<uint>(level) == 0 || static_cast<uint>(level) >= DLOG_MIN_LEVEL;
+		}
+
+		/// Switch async mode on or off.
+		/// In async mode the destructor hands the output
+		/// over to a background printer thread instead of
+		/// writing it to the stream on the calling thread.
+		/// Switching async mode off prints all pending output,
+		/// including notes about repeated records, before returning.
+		static void set_async(const bool _async)
+		{
+			if (_async)
+			{
+				spawn_printer();
+				async.store(true, std::memory_order_release);
+			}
+			else
+			{
+				async.store(false, std::memory_order_release);
+				printer.stop();
+				settle();
+			}
+		}
+
+		/// Log a message without formatting it on the calling thread.
+		/// The arguments follow the same pattern as the constructors
+		/// (an optional stream and an optional AffixSet, followed by the
+		/// values to print), but the values are limited to arithmetic
+		/// types, strings and pointers. They are copied into a compact
+		/// record which the printer thread turns into text in async mode.
+		/// Strings, including character arrays, are copied. String
+		/// literals wrapped in DLOG_LIT are stored by pointer.
+		template<typename ... Args, typename = std::enable_if_t<!selects_stream<Args...>()>>
+		static void defer(Args&& ... _args)
+		{
+			defer_to(std::cout, nullptr, std::forward<Args>(_args)...);
+		}
+
+		template<typename Stream, typename ... Args, typename = std::enable_if_t<std::is_base_of_v<std::ostream, Stream>>>
+		static void defer(Stream& _stream, Args&& ... _args)
+		{
+			defer_to(_stream, nullptr, std::forward<Args>(_args)...);
+		}
+
+		template<typename Stream, typename ... Args, typename = std::enable_if_t<std::is_base_of_v<std::ostream, Stream>>>
+		static void defer(const std::shared_ptr<Stream>& _stream, Args&& ... _args)
+		{
+			defer_to(*_stream, _stream, std::forward<Args>(_args)...);
+		}
+
+		/// Block until all output handed over to the printer
+		/// thread has been printed, then write the notes about
+		/// repeated records which are still pending.
+		static void drain()
+		{
+			printer.drain();
+			settle();
+		}
+
+		/// Counters of the write path, summed over all
+		/// threads, and the records written to each stream.
+		/// The counters are always zero if DLOG_STATS is 0.
+		static Stats stats()
+		{
+			Stats s;
+			meter.collect(s);
+			registry.each([&](Sink& _sink)
+			{
+				const std::uint64_t records(_sink.records.load(std::memory_order_relaxed));
+				const std::uint64_t dropped(_sink.dropped.load(std::memory_order_relaxed));
+				s.dropped += dropped;
+				if (records > 0 || dropped > 0)
+				{
+					s.streams.push_back({_sink.stream.load(std::memory_order_relaxed),
+										 records,
+										 _sink.bytes.load(std::memory_order_relaxed),
+										 dropped,
+										 _sink.lock_wait.load(std::memory_order_relaxed),
+										 _sink.write_time.load(std::memory_order_relaxed)});
+				}
+			});
+			return s;
+		}
+
+	private:
+
+		/// Indicates whether a message at log level
+		/// _level should be printed to _stream.
+		static bool passes(const uint _level, std::ostream& _stream)
+		{
+			if (_level == 0)
+			{
+				return true;
+			}
+
+			if (_level < log_level.level.load(std::memory_order_relaxed))
+			{
+				return false;
+			}
+
+			return !log_level.per_stream.load(std::memory_order_relaxed) ||
+				   _level >= registry.find(std::addressof(_stream)).log_level.load(std::memory_order_relaxed);
+		}
+
+		/// Encoding of _stream.
+		static Encoding encoding_of(std::ostream& _stream)
+		{
+			return log_level.encoded.load(std::memory_order_relaxed) ?
+				   registry.find(std::addressof(_stream)).encoding.load(std::memory_order_relaxed) :
+				   Encoding::Text;
+		}
+
+		static void spawn_printer()
+		{
+			printer.start();
+		}
+
+		template<typename ... Args>
+		void init() {}
+
+		template<typename Arg, typename ... Args>
+		void init(Arg&& _arg, Args&& ... _args)
+		{
+			if (out)
+			{
+				if (encoding == Encoding::Text)
+				{
+					text(afx.prefix);
+				}
+				put(std::forward<Arg>(_arg));
+				gobble(std::forward<Args>(_args)...);
+			}
+		}
+
+		template<typename ... Args>
+		void gobble(Args&& ... _args)
+		{
+			if (out)
+			{
+				(next(std::forward<Args>(_args)), ...);
+			}
+		}
+
+		/// Write an argument preceded by the infix. With a
+		/// structured encoding, the infix only separates
+		/// the arguments which are not fields.
+		template<typename T>
+		void next(T&& _t)
+		{
+			if (encoding == Encoding::Text ||
+				(!is_field<std::decay_t<T>> && !scratch->storage.view().empty()))
+			{
+				text(afx.infix);
+			}
+			put(std::forward<T>(_t));
+		}
+
+		/// Write a single argument to the buffer.
+		/// Callables taking no arguments are invoked and
+		/// their result is written instead, so expensive
+		/// arguments are only computed if the message
+		/// is actually printed.
+		template<typename T>
+		void put(T&& _t)
+		{
+			if constexpr (std::is_invocable_v<T&>)
+			{
+				put(std::invoke(_t));
+			}
+			else if constexpr (is_direct<std::decay_t<T>>)
+			{
+				if (!scratch->direct() || !direct(_t))
+				{
+					if constexpr (std::is_floating_point_v<std::decay_t<T>>)
+					{
+						print_float(buffer, _t);
+					}
+					else
+					{
+						buffer << std::forward<T>(_t);
+					}
+				}
+			}
+			else if constexpr (is_field<std::decay_t<T>>)
+			{
+				field(_t.key, _t.value);
+			}
+			else if constexpr (is_rounded<std::decay_t<T>>)
+			{
+				std::array<char, 128> text;
+				const char* end(scratch->plain && buffer.width() == 0 ?
+								to_text(text.data(), text.data() + text.size(), _t.value, _t.notation, _t.precision) :
+								nullptr);
+				if (end != nullptr)
+				{
+					scratch->storage.append(text.data(), static_cast<std::size_t>(end - text.data()));
+				}
+				else
+				{
+					buffer << _t;
+				}
+			}
+			else
+			{
+				buffer << std::forward<T>(_t);
+			}
+		}
+
+		/// Write a field as key=value, or add it to the
+		/// fields of the record with a structured encoding.
+		template<typename T>
+		void field(const std::string_view _key, T&& _value)
+		{
+			using V = std::decay_t<T>;
+
+			if constexpr (std::is_invocable_v<T&>)
+			{
+				field(_key, std::invoke(_value));
+			}
+			else if (encoding == Encoding::Text)
+			{
+				scratch->storage.append(_key.data(), _key.size());
+				scratch->storage.append("=", 1);
+				put(std::forward<T>(_value));
+			}
+			else
+			{
+				const bool json(encoding == Encoding::Json);
+				if (fields == nullptr)
+				{
+					fields = Pool::borrow();
+				}
+				Buffer& rec(fields->storage);
+				rec.append(json ? "," : " ", 1);
+				key(rec, json, _key);
+
+				if constexpr (std::is_same_v<V, bool>)
+				{
+					if (_value)
+					{
+						rec.append("true", 4);
+					}
+					else
+					{
+						rec.append("false", 5);
+					}
+				}
+				else
+				{
+					/// Numbers printed with the default format are
+					/// written as they are, anything else as a string.
+					bool number(false);
+					if constexpr (std::is_floating_point_v<V>)
+					{
+						number = std::isfinite(_value);
+					}
+					else if constexpr (is_rounded<V>)
+					{
+						number = std::isfinite(_value.value);
+					}
+					else
+					{
+						number = std::is_integral_v<V> && is_direct<V>;
+					}
+					number = number && scratch->direct();
+
+					/// Format the value at the end of the message
+					/// text, move it to the fields and cut it off.
+					Buffer& text(scratch->storage);
+					const std::size_t mark(text.view().size());
+					put(std::forward<T>(_value));
+					const std::string_view value(text.view().substr(mark));
+					if (number)
+					{
+						rec.append(value.data(), value.size());
+					}
+					else
+					{
+						quote(rec, json, value);
+					}
+					text.truncate(mark);
+				}
+			}
+		}
+
+		/// Write the key of a member of a structured record.
+		static void key(Buffer& _out, const bool _json, const std::string_view _key)
+		{
+			if (_json)
+			{
+				_out.append("\"", 1);
+				escape_json(_out, _key);
+				_out.append("\":", 2);
+			}
+			else
+			{
+				_out.append(_key.data(), _key.size());
+				_out.append("=", 1);
+			}
+		}
+
+		/// Write a string value of a structured record.
+		static void quote(Buffer& _out, const bool _json, const std::string_view _value)
+		{
+			if (_json)
+			{
+				_out.append("\"", 1);
+				escape_json(_out, _value);
+				_out.append("\"", 1);
+			}
+			else
+			{
+				escape_logfmt(_out, _value);
+			}
+		}
+
+		/// Assemble the record of a message for a stream
+		/// with a structured encoding and submit it.
+		/// The time is the first member of the record.
+		/// Like a layout, it is rendered when the record
+		/// is written, so it is not part of the content.
+		void submit_record()
+		{
+			static const std::shared_ptr<const Layout> json_time(std::make_shared<Layout>("{\"time\":\"%T\""));
+			static const std::shared_ptr<const Layout> logfmt_time(std::make_shared<Layout>("time=\"%T\""));
+
+			const bool json(encoding == Encoding::Json);
+			const bool timed(afx.layout != nullptr);
+			Scratch* line(Pool::borrow());
+			Buffer& rec(line->storage);
+			if (json && !timed)
+			{
+				rec.append("{", 1);
+			}
+			const std::size_t start(rec.view().size());
+
+			const auto member([&](const std::string_view _key)
+			{
+				if (timed || rec.view().size() > start)
+				{
+					rec.append(json ? "," : " ", 1);
+				}
+				key(rec, json, _key);
+			});
+
+			if (afx.log_level != 0)
+			{
+				std::array<char, 16> digits;
+				member("level");
+				rec.append(digits.data(), static_cast<std::size_t>(std::to_chars(digits.data(), digits.data() + digits.size(), afx.log_level).ptr - digits.data()));
+			}
+
+			const std::string_view msg(scratch->storage.view());
+			if (!msg.empty())
+			{
+				member("msg");
+				quote(rec, json, msg);
+			}
+
+			if (fields != nullptr)
+			{
+				/// Each field starts with a separator.
+				std::string_view members(fields->storage.view());
+				if (!timed && rec.view().size() == start)
+				{
+					members.remove_prefix(1);
+				}
+				rec.append(members.data(), members.size());
+			}
+
+			rec.append(json ? "}\n" : "\n", json ? 2 : 1);
+			if (timed)
+			{
+				const Stamp stamp{json ? json_time : logfmt_time, {afx.log_level, Timestamp::clock(), std::this_thread::get_id()}};
+				submit(stream, ofs, rec.view(), afx.log_level, nullptr, &stamp);
+			}
+			else
+			{
+				submit(stream, ofs, rec.view(), afx.log_level);
+			}
+			Pool::give_back(line);
+		}
+
+		/// Write a string (an affix) to the buffer.
+		void text(const std::string& _str)
+		{
+			if (buffer.width() == 0)
+			{
+				scratch->storage.append(_str.data(), _str.size());
+			}
+			else
+			{
+				buffer << _str;
+			}
+		}
+
+		/// Types written without going through the stream
+		/// (as long as the stream uses the default format).
+		/// Character types and character pointers are
+		/// excluded since the stream prints them as text.
+		template<typename T>
+		static constexpr bool is_direct
+		{
+			std::is_floating_point_v<T> ||
+			std::is_same_v<T, bool> ||
+			std::is_same_v<T, std::thread::id> ||
+			(std::is_integral_v<T> &&
+			 !std::is_same_v<T, char> &&
+			 !std::is_same_v<T, signed char> &&
+			 !std::is_same_v<T, unsigned char> &&
+			 !std::is_same_v<T, wchar_t> &&
+			 !std::is_same_v<T, char16_t> &&
+			 !std::is_same_v<T, char32_t>) ||
+			(std::is_pointer_v<T> &&
+			 !std::is_function_v<std::remove_pointer_t<T>> &&
+			 !std::is_same_v<std::remove_cv_t<std::remove_pointer_t<T>>, char> &&
+			 !std::is_same_v<std::remove_cv_t<std::remove_pointer_t<T>>, signed char> &&
+			 !std::is_same_v<std::remove_cv_t<std::remove_pointer_t<T>>, unsigned char>)
+		};
+
+		/// Write numbers, bools, pointers and the ID of the
+		/// current thread straight into the buffer, producing
+		/// the same text as the stream would with the default
+		/// format, except that floating-point numbers are
+		/// written as the shortest text which reads back as
+		/// the same value. Returns false if the value has to
+		/// go through the stream after all.
+		template<typename T>
+		bool direct(const T& _value)
+		{
+			/// Room for the sign and the digits of any 64-bit
+			/// integer, a pointer in hex or the shortest text
+			/// of a floating-point number.
+			std::array<char, 64> digits;
+			char* const first(digits.data());
+			char* last(first);
+
+			if constexpr (std::is_floating_point_v<T>)
+			{
+				last = to_text(first, first + digits.size(), _value);
+				if (last == nullptr)
+				{
+					return false;
+				}
+			}
+			else if constexpr (std::is_same_v<T, bool>)
+			{
+				*last++ = _value ? '1' : '0';
+			}
+			else if constexpr (std::is_same_v<T, std::thread::id>)
+			{
+				if (_value != std::this_thread::get_id())
+				{
+					return false;
+				}
+				const std::string& id(thread_id());
+				scratch->storage.append(id.data(), id.size());
+				return true;
+			}
+			else if constexpr (std::is_pointer_v<T>)
+			{
+				const std::uintptr_t address(reinterpret_cast<std::uintptr_t>(_value));
+				if (address == 0)
+				{
+					return false;
+				}
+				*last++ = '0';
+				*last++ = 'x';
+				last = std::to_chars(last, first + digits.size(), address, 16).ptr;
+			}
+			else
+			{
+				const std::to_chars_result result(std::to_chars(first, first + digits.size(), _value));
+				if (result.ec != std::errc())
+				{
+					return false;
+				}
+				last = result.ptr;
+			}
+
+			scratch->storage.append(first, static_cast<std::size_t>(last - first));
+			return true;
+		}
+
+		/// ID of the calling thread as printed by the stream.
+		static const std::string& thread_id()
+		{
+			thread_local const std::string id([]
+			{
+				std::ostringstream os;
+				os << std::this_thread::get_id();
+				return os.str();
+			}());
+			return id;
+		}
+
+		/// Hand the output over to the printer in async mode,
+		/// or write it to the stream straight away.
+		static void submit(std::ostream& _stream, const std::shared_ptr<std::ostream>& _ofs, const std::string_view _content, const uint _level, const Format* _format = nullptr, const Stamp* _stamp = nullptr)
+		{
+			if (_content.empty())
+			{
+				return;
+			}
+
+			if (async.load(std::memory_order_acquire) &&
+				printer.push(std::addressof(_stream), _ofs, _content, _format, _stamp, _level))
+			{
+				return;
+			}
+
+			printer.catch_up();
+			write(_stream, _content, _format, _stamp, _level);
+		}
+
+		/// Capture the values rendered by the layout.
+		static Stamp make_stamp(const AffixSet& _afx)
+		{
+			return {_afx.layout, {_afx.log_level, Timestamp::clock(), std::this_thread::get_id()}};
+		}
+
+		/// Write a finished or deferred message to a stream,
+		/// preceded by the rendered layout if there is one.
+		static void write(std::ostream& _stream, const std::string_view _content, const Format* _format, const Stamp* _stamp = nullptr, const uint _level = 0)
+		{
+			const bool layout(_stamp != nullptr && _stamp->layout);
+
+			/// Deferred messages are rendered as text, anything
+			/// else is already in the encoding of _stream.
+			const Encoding source(_format == nullptr ? encoding_of(_stream) : Encoding::Text);
+			const Kind kind(registry.kind(std::addressof(_stream)));
+
+			if (kind == Kind::Tee)
+			{
+				const Tee* tee(static_cast<const Tee*>(std::addressof(_stream)));
+				/// Text rendered once for all streams that need it
+				/// and the size of the layout at its start.
+				Scratch* text(nullptr);
+				std::size_t head(0);
+				for (std::ostream* os : tee->streams())
+				{
+					if (!accepts(*os, _level))
+					{
+						continue;
+					}
+
+					if (registry.kind(os) == Kind::Binary)
+					{
+						write(*os, _content, _format, _stamp, _level);
+						continue;
+					}
+
+					if (_format == nullptr && !layout)
+					{
+						deliver(*os, _content, 0, source, _level);
+						continue;
+					}
+
+					if (text == nullptr)
+					{
+						text = Pool::borrow();
+						head = render(*text, _content, _format, _stamp);
+					}
+					deliver(*os, text->storage.view(), head, source, _level);
+				}
+				if (text != nullptr)
+				{
+					Pool::give_back(text);
+				}
+				return;
+			}
+
+			if (kind == Kind::Binary)
+			{
+				BinaryFile* bin(static_cast<BinaryFile*>(std::addressof(_stream)));
+				Scratch* head(nullptr);
+				if (layout)
+				{
+					head = Pool::borrow();
+					_stamp->layout->render(head->stream, _stamp->fields);
+				}
+				const std::size_t bytes(_content.size() + (head != nullptr ? head->storage.view().size() : 0));
+				locked(registry.find(bin), bytes, [&]
+				{
+					if (head != nullptr)
+					{
+						bin->text(head->storage.view());
+					}
+					if (_format == nullptr)
+					{
+						bin->text(_content);
+					}
+					else
+					{
+						bin->record(*_format, _content);
+					}
+				});
+				if (head != nullptr)
+				{
+					Pool::give_back(head);
+				}
+				return;
+			}
+
+			if (_format == nullptr && !layout)
+			{
+				deliver(_stream, _content, 0, source, _level);
+				return;
+			}
+
+			Scratch* text(Pool::borrow());
+			const std::size_t head(render(*text, _content, _format, _stamp));
+			deliver(_stream, text->storage.view(), head, source, _level);
+			Pool::give_back(text);
+		}
+
+		/// Write a record in the _source encoding to _stream.
+		/// Text sent to a stream with a structured encoding
+		/// is first wrapped in a record of its own.
+		static void deliver(std::ostream& _stream, const std::string_view _record, const std::size_t _head, const Encoding _source, const uint _level)
+		{
+			const Encoding encoding(_source == Encoding::Text ? encoding_of(_stream) : _source);
+			if (encoding == _source)
+			{
+				flush(_stream, _record, _head);
+				return;
+			}
+
+			Scratch* rec(Pool::borrow());
+			const std::size_t head(wrap(rec->storage, encoding == Encoding::Json, _record, _head, _level));
+			flush(_stream, rec->storage.view(), head);
+			Pool::give_back(rec);
+		}
+
+		/// Write a line of text as a structured record holding
+		/// the log level (unless it is 0) and the line without
+		/// its line break as "msg". Returns the size of the record
+		/// up to the end of the first _head characters of the line,
+		/// which are the layout.
+		static std::size_t wrap(Buffer& _out, const bool _json, std::string_view _line, const std::size_t _head, const uint _level)
+		{
+			if (!_line.empty() && _line.back() == '\n')
+			{
+				_line.remove_suffix(1);
+			}
+
+			if (_json)
+			{
+				_out.append("{", 1);
+			}
+			if (_level != 0)
+			{
+				std::array<char, 16> digits;
+				key(_out, _json, "level");
+				_out.append(digits.data(), static_cast<std::size_t>(std::to_chars(digits.data(), digits.data() + digits.size(), _level).ptr - digits.data()));
+				_out.append(_json ? "," : " ", 1);
+			}
+			key(_out, _json, "msg");
+			_out.append("\"", 1);
+			escape_json(_out, _line.substr(0, std::min(_head, _line.size())));
+			const std::size_t head(_out.view().size());
+			escape_json(_out, _line.substr(std::min(_head, _line.size())));
+			_out.append(_json ? "\"}\n" : "\"\n", _json ? 3 : 2);
+			return head;
+		}
+
+		/// Write the text of a message to _out: the layout
+		/// followed by the content, decoded if it is deferred.
+		/// Returns the size of the layout.
+		static std::size_t render(Scratch& _out, const std::string_view _content, const Format* _format, const Stamp* _stamp)
+		{
+			if (_stamp != nullptr && _stamp->layout)
+			{
+				_stamp->layout->render(_out.stream, _stamp->fields);
+			}
+			const std::size_t head(_out.storage.view().size());
+			if (_format == nullptr)
+			{
+				_out.storage.append(_content.data(), _content.size());
+			}
+			else
+			{
+				Codec::print(_out.stream, *_format, _content);
+			}
+			return head;
+		}
+
+		/// Indicates whether a stream in a tee accepts
+		/// messages at _level. The tee itself has already
+		/// been checked against the global log level.
+		static bool accepts(std::ostream& _stream, const uint _level)
+		{
+			return _level == 0 ||
+				   !log_level.per_stream.load(std::memory_order_relaxed) ||
+				   _level >= registry.find(std::addressof(_stream)).log_level.load(std::memory_order_relaxed);
+		}
+
+		/// Flush a stream, or each stream in a tee, with
+		/// the mutex of the stream held, after writing the
+		/// pending note about repeated records if it is due
+		/// (see repeated()). The sinks of streams whose note
+		/// is not due yet are added to _lingering.
+		static void sync(std::ostream& _stream, const bool _final = false, std::vector<Sink*>* _lingering = nullptr)
+		{
+			if (registry.kind(std::addressof(_stream)) == Kind::Tee)
+			{
+				for (std::ostream* os : static_cast<const Tee&>(_stream).streams())
+				{
+					sync(*os, _final, _lingering);
+				}
+				return;
+			}
+
+			Sink& sink(registry.find(std::addressof(_stream)));
+			locked(sink, 0, [&]() -> std::size_t
+			{
+				const std::size_t bytes(repeated(_stream, sink, _final));
+				_stream.flush();
+				if (sink.repeats > 0 && _lingering != nullptr)
+				{
+					_lingering->push_back(std::addressof(sink));
+				}
+				return bytes;
+			});
+		}
+
+		/// Encode a deferred message and submit it.
+		template<typename ... Args>
+		static void defer_to(std::ostream& _stream, const std::shared_ptr<std::ostream>& _ofs, Args&& ... _args)
+		{
+			if constexpr (!std::is_same_v<first_t<Args...>, AffixSet>)
+			{
+				defer_to(_stream, _ofs, AffixSet(), std::forward<Args>(_args)...);
+			}
+			else
+			{
+				encode(_stream, _ofs, std::forward<Args>(_args)...);
+			}
+		}
+
+		template<typename ... Args>
+		static void encode(std::ostream& _stream, const std::shared_ptr<std::ostream>& _ofs, const AffixSet& _afx, Args&& ... _args)
+		{
+			if (!passes(_afx.log_level, _stream))
+			{
+				return;
+			}
+
+			Scratch* payload(Pool::borrow());
+			Codec::header(payload->storage, _afx);
+			(Codec::put(payload->storage, std::forward<Args>(_args)), ...);
+			if (_afx.layout)
+			{
+				const Stamp stamp(make_stamp(_afx));
+				submit(_stream, _ofs, payload->storage.view(), _afx.log_level, Codec::format<Args...>(), &stamp);
+			}
+			else
+			{
+				submit(_stream, _ofs, payload->storage.view(), _afx.log_level, Codec::format<Args...>());
+			}
+			Pool::give_back(payload);
+		}
+
+		/// Write a record to a stream. The first _head
+		/// characters are the layout, which is left out
+		/// when the record is compared with the last one.
+		static void flush(std::ostream& _stream, const std::string_view _content, const std::size_t _head = 0)
+		{
+			if (_content.empty())
+			{
+				return;
+			}
+
+			Sink& sink(registry.find(std::addressof(_stream)));
+			if (!sink.collapse.load(std::memory_order_relaxed) || registry.shared(sink))
+			{
+				locked(sink, _content.size(), [&]
+				{
+					_stream.write(_content.data(), static_cast<std::streamsize>(_content.size()));
+				});
+				return;
+			}
+
+			/// The hash is computed before the mutex is locked.
+			const std::string_view body(_content.substr(_head));
+			const std::uint64_t hash(digest(body));
+			locked(sink, _content.size(), [&]() -> std::size_t
+			{
+				if (hash == sink.last_hash && body == sink.last)
+				{
+					if (sink.repeats++ == 0)
+					{
+						sink.noted_at = std::chrono::steady_clock::now();
+						return 0;
+					}
+					return repeated(_stream, sink, false);
+				}
+
+				const std::size_t bytes(repeated(_stream, sink, true));
+				_stream.write(_content.data(), static_cast<std::streamsize>(_content.size()));
+				sink.last.assign(body.data(), body.size());
+				sink.last_hash = hash;
+				return bytes + _content.size();
+			});
+		}
+
+		/// Write the note about repeats of the last record
+		/// of _sink which have not been reported yet, if the
+		/// last note is at least a second old or _final is set.
+		/// Called with the mutex of _sink held.
+		/// Returns the size of the note.
+		static std::size_t repeated(std::ostream& _stream, Sink& _sink, const bool _final)
+		{
+			if (_sink.repeats == 0)
+			{
+				return 0;
+			}
+
+			const std::chrono::steady_clock::time_point now(std::chrono::steady_clock::now());
+			if (!_final && now - _sink.noted_at < std::chrono::seconds(1))
+			{
+				return 0;
+			}
+
+			const std::string text(notice(_sink, "last message repeated " + std::to_string(_sink.repeats) + (_sink.repeats == 1 ? " time" : " times")));
+			_stream.write(text.data(), static_cast<std::streamsize>(text.size()));
+			_sink.repeats = 0;
+			_sink.noted_at = now;
+			return text.size();
+		}
+
+		/// Write the pending note of _sink (see repeated())
+		/// and flush its stream. A sink only has repeats while
+		/// its stream is registered, since releasing the slot
+		/// clears them. Returns true if the note is not due yet.
+		static bool settle(Sink& _sink, const bool _final)
+		{
+			bool pending(false);
+			locked(_sink, 0, [&]() -> std::size_t
+			{
+				if (_sink.repeats == 0)
+				{
+					return 0;
+				}
+				std::ostream& stream(*_sink.stream.load(std::memory_order_acquire));
+				const std::size_t bytes(repeated(stream, _sink, _final));
+				stream.flush();
+				pending = _sink.repeats > 0;
+				return bytes;
+			});
+			return pending;
+		}
+
+		/// Write the pending notes of all streams.
+		static void settle()
+		{
+			registry.each([](Sink& _sink)
+			{
+				settle(_sink, true);
+			});
+		}
+
+		/// Hash of a record, compared before the
+		/// record itself to find repeated records.
+		static std::uint64_t digest(const std::string_view _str)
+		{
+			constexpr std::uint64_t mul{0xff51afd7ed558ccdull};
+			std::uint64_t h(0x9e3779b97f4a7c15ull ^ _str.size());
+			std::size_t i(0);
+			for (; i + 8 <= _str.size(); i += 8)
+			{
+				std::uint64_t word;
+				std::memcpy(&word, _str.data() + i, 8);
+				h = (h ^ word) * mul;
+				h ^= h >> 32;
+			}
+			std::uint64_t tail(0);
+			std::memcpy(&tail, _str.data() + i, _str.size() - i);
+			h = (h ^ tail) * mul;
+			return h ^ (h >> 32);
+		}
+
+		/// A note written by dlog itself (about dropped or
+		/// repeated records) in the encoding of the stream.
+		static std::string notice(const Sink& _sink, const std::string& _text)
+		{
+			switch (_sink.encoding.load(std::memory_order_relaxed))
+			{
+			case Encoding::Json:
+				return "{\"msg\":\"" + _text + "\"}\n";
+			case Encoding::Logfmt:
+				return "msg=\"" + _text + "\"\n";
+			default:
+				return _text + "\n";
+			}
+		}
+
+		/// Call _fn with the mutex of _sink held.
+		/// _bytes is the size of the record written
+		/// by _fn (0 if it only flushes the stream),
+		/// unless _fn returns the size it has written.
+		template<typename Fn>
+		static void locked(Sink& _sink, std::size_t _bytes, Fn&& _fn)
+		{
+#if DLOG_STATS
+			using clock = std::chrono::steady_clock;
+			const clock::time_point start(clock::now());
+			glock lk(_sink.mutex);
+			const clock::time_point acquired(clock::now());
+			if constexpr (std::is_void_v<std::invoke_result_t<Fn&>>)
+			{
+				_fn();
+			}
+			else
+			{
+				_bytes = _fn();
+			}
+			const clock::time_point done(clock::now());
+
+			const std::uint64_t wait(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(acquired - start).count()));
+			const std::uint64_t busy(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(done - acquired).count()));
+			if (_bytes > 0)
+			{
+				Counters::add(_sink.records, 1);
+				Counters::add(_sink.bytes, _bytes);
+			}
+			Counters::add(_sink.lock_wait, wait);
+			Counters::add(_sink.write_time, busy);
+
+			Counters* c(Meter::local());
+			if (c == nullptr)
+			{
+				return;
+			}
+			if (_bytes > 0)
+			{
+				Counters::add(c->records, 1);
+				Counters::add(c->bytes, _bytes);
+			}
+			Counters::add(c->lock_wait, wait);
+			Counters::add(c->write_time, busy);
+			if (wait > c->max_lock_wait.load(std::memory_order_relaxed))
+			{
+				c->max_lock_wait.store(wait, std::memory_order_relaxed);
+			}
+#else
+			glock lk(_sink.mutex);
+			_fn();
+#endif
+		}
+	};
+
+	inline dlog::Threshold dlog::log_level;
+
+	inline dlog::Registry dlog::registry;
+
+	inline dlog::Meter dlog::meter;
+
+	inline dlog::Printer dlog::printer;
+}
+
+/// Mark a string literal which dlog::defer() can store
+/// by pointer, for example DLOG_LIT("Processed"). Anything
+/// other than a string literal does not compile.
+#define DLOG_LIT(str) (Async::Literal{"" str})
+
+/// Log a message at a fixed log level, for example
+///
+/// DLOG(LogLevel::Info, afx(LogLevel::Info), "Value:", value);
+///
+/// The remaining arguments are passed to the dlog constructor.
+/// If the level is below DLOG_MIN_LEVEL, the statement compiles
+/// to nothing. If it is below the current log level, the
+/// statement reduces to a single check. In both cases the
+/// arguments are not evaluated and no dlog object is created.
+#define DLOG(level, ...) \
+	if constexpr (!Async::dlog::enabled<level>()) {} \
+	else if (!Async::dlog::active(level)) {} \
+	else (Async::dlog(__VA_ARGS__))
+
+/// State of the call site which expands it.
+/// Every expansion creates a lambda of its own,
+/// and with it a static Site of its own.
+#define DLOG_SITE \
+	([]() -> Async::Site& { static Async::Site site; return site; }())
+
+/// Log a message at a fixed log level, like DLOG, but only
+/// if the call site lets it pass. The site is checked after
+/// the log level and before the arguments are evaluated.
+/// If messages have been suppressed since the site last
+/// passed, their number is added to the message as the
+/// field "suppressed".
+#define DLOG_LIMITED(level, check, ...) \
+	if constexpr (!Async::dlog::enabled<level>()) {} \
+	else if (!Async::dlog::active(level)) {} \
+	else if (const std::uint64_t dlog_suppressed_ = DLOG_SITE.check; dlog_suppressed_ == Async::Site::closed) {} \
+	else Async::dlog(__VA_ARGS__).suppressed(dlog_suppressed_)
+
+/// Log the first of every n messages from this call site.
+#define DLOG_EVERY_N(level, n, ...) \
+	DLOG_LIMITED(level, every_n(n), __VA_ARGS__)
+
+/// Log the first n messages from this call site.
+#define DLOG_FIRST_N(level, n, ...) \
+	DLOG_LIMITED(level, first_n(n), __VA_ARGS__)
+
+/// Log at most one message per interval
+/// (a std::chrono::duration) from this call site.
+#define DLOG_EVERY(level, interval, ...) \
+	DLOG_LIMITED(level, every(interval), __VA_ARGS__)
 
 #endif // DLOG_HPP
@@ -0,0 +1,459 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <memory>
+#include "dlog.hpp"
+
+///=============================================================================
+///	Latency and thread scaling benchmarks for the log call.
+///
+///	Usage: dlog_bench [--suite latency|scaling|all] [--count N] [--rate R]
+///	                  [--threads T] [--dir D]
+///
+///	Latency: every case logs N messages (100000 by default) at a fixed rate of
+///	R messages per second (200000 by default). The latency of each call
+///	is measured from the time at which it was scheduled to start rather
+///	than from the time it actually started, so a stall is charged to all
+///	the calls that were held up by it (avoiding coordinated omission).
+///	The time spent in the call itself is reported as the service time.
+///
+///	Scaling: 1, 2, 4, ... up to T threads (the number of cores by default)
+///	log N messages each as fast as they can, first all to the same file
+///	and then each to its own file, in sync and in async mode. The
+///	aggregate throughput, the latency percentiles of all calls and the
+///	time spent waiting for stream locks (see dlog::stats()) are reported
+///	for each thread count.
+///
+///	Log files are written to directory D (the current directory by default).
+///	The results are written to std::cout in JSON format.
+///=============================================================================
+
+using namespace Async;
+
+using Clock = std::chrono::steady_clock;
+
+///=============================================================================
+///	Sinks and options
+///=============================================================================
+
+/// Stream buffer which discards its input.
+class NullBuffer : public std::streambuf
+{
+protected:
+
+	int_type overflow(int_type _c) override
+	{
+		return traits_type::not_eof(_c);
+	}
+
+	std::streamsize xsputn(const char*, std::streamsize _n) override
+	{
+		return _n;
+	}
+};
+
+struct Options
+{
+	std::string suite{"all"};
+	std::size_t count{100000};
+	double rate{200000};
+	uint threads{std::max(1u, std::thread::hardware_concurrency())};
+	std::string dir{"."};
+};
+
+/// Latency percentiles of a single case (in nanoseconds).
+struct Summary
+{
+	std::string sink;
+	std::string args;
+	std::size_t size{0};
+	std::size_t count{0};
+	std::int64_t p50{0};
+	std::int64_t p99{0};
+	std::int64_t p999{0};
+	std::int64_t max{0};
+	std::int64_t service_p50{0};
+	std::int64_t service_max{0};
+};
+
+/// Throughput and latency for a number of threads (in nanoseconds).
+struct Scaling
+{
+	std::string mode;
+	std::string streams;
+	uint threads{0};
+	std::size_t count{0};
+	double throughput{0};
+	std::int64_t p50{0};
+	std::int64_t p99{0};
+	std::int64_t p999{0};
+	std::int64_t max{0};
+
+	/// Time spent waiting for and holding
+	/// stream locks, summed over all threads.
+	std::uint64_t lock_wait{0};
+	std::uint64_t write_time{0};
+};
+
+///=============================================================================
+///	Measurement
+///=============================================================================
+
+std::int64_t percentile(const std::vector<std::int64_t>& _sorted, const double _p)
+{
+	const std::size_t rank(static_cast<std::size_t>(_p * static_cast<double>(_sorted.size() - 1) + 0.5));
+	return _sorted[std::min(rank, _sorted.size() - 1)];
+}
+
+/// Call _log(i) for i in [0, count) at the given rate
+/// and record the latency and service time of each call.
+template<typename Fn>
+Summary measure(const Options& _opt, Fn&& _log)
+{
+	std::vector<std::int64_t> latency(_opt.count);
+	std::vector<std::int64_t> service(_opt.count);
+
+	/// Warm up the pools, rings and caches.
+	for (std::size_t i = 0; i < _opt.count / 10; ++i)
+	{
+		_log(i);
+	}
+	dlog::drain();
+
+	const std::chrono::duration<double, std::nano> interval(1e9 / _opt.rate);
+	const Clock::time_point start(Clock::now());
+	for (std::size_t i = 0; i < _opt.count; ++i)
+	{
+		const Clock::time_point scheduled(start + std::chrono::duration_cast<Clock::duration>(interval * static_cast<double>(i)));
+		while (Clock::now() < scheduled)
+		{
+		}
+
+		const Clock::time_point begin(Clock::now());
+		_log(i);
+		const Clock::time_point end(Clock::now());
+
+		latency[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - scheduled).count();
+		service[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+	}
+	dlog::drain();
+
+	std::sort(latency.begin(), latency.end());
+	std::sort(service.begin(), service.end());
+
+	Summary s;
+	s.count = _opt.count;
+	s.p50 = percentile(latency, 0.5);
+	s.p99 = percentile(latency, 0.99);
+	s.p999 = percentile(latency, 0.999);
+	s.max = latency.back();
+	s.service_p50 = percentile(service, 0.5);
+	s.service_max = service.back();
+	return s;
+}
+
+/// Run all argument mixes against one stream.
+void run(const Options& _opt, const std::string& _sink, std::ostream& _stream, std::vector<Summary>& _results)
+{
+	for (const std::size_t size : {16, 128, 1024})
+	{
+		const std::string text(size, 'x');
+		Summary s(measure(_opt, [&](const std::size_t)
+		{
+			dlog(_stream, text);
+		}));
+		s.sink = _sink;
+		s.args = "text";
+		s.size = size;
+		_results.push_back(std::move(s));
+	}
+
+	{
+		Summary s(measure(_opt, [&](const std::size_t _i)
+		{
+			dlog(_stream, "Values:", _i, _i * 3, -static_cast<long>(_i), _i % 7);
+		}));
+		s.sink = _sink;
+		s.args = "integers";
+		_results.push_back(std::move(s));
+	}
+
+	{
+		const std::string text(32, 'x');
+		Summary s(measure(_opt, [&](const std::size_t _i)
+		{
+			dlog(_stream, "Mixed:", _i, 0.25 * static_cast<double>(_i), text, 'c', true);
+		}));
+		s.sink = _sink;
+		s.args = "mixed";
+		_results.push_back(std::move(s));
+	}
+
+	{
+		Summary s(measure(_opt, [&](const std::size_t _i)
+		{
+			dlog::defer(_stream, DLOG_LIT("Deferred:"), _i, 0.25 * static_cast<double>(_i), DLOG_LIT("text"));
+		}));
+		s.sink = _sink;
+		s.args = "deferred";
+		_results.push_back(std::move(s));
+	}
+}
+
+/// Log from _threads threads at once, either to one
+/// shared file or to a separate file for each thread.
+Scaling scale(const Options& _opt, const uint _threads, const bool _shared)
+{
+	std::vector<std::unique_ptr<std::ofstream>> files;
+	for (uint t = 0; t < (_shared ? 1 : _threads); ++t)
+	{
+		files.emplace_back(std::make_unique<std::ofstream>(_opt.dir + "/dlog_bench_" + std::to_string(t) + ".log", std::ios::out | std::ios::trunc));
+	}
+
+	std::vector<std::vector<std::int64_t>> latency(_threads, std::vector<std::int64_t>(_opt.count));
+	std::atomic<uint> ready{0};
+	std::atomic<bool> go{false};
+
+	std::vector<std::thread> workers;
+	for (uint t = 0; t < _threads; ++t)
+	{
+		workers.emplace_back([&, t]
+		{
+			std::ostream& stream(*files[_shared ? 0 : t]);
+			std::vector<std::int64_t>& lat(latency[t]);
+
+			/// Warm up the pool and the ring of this thread.
+			for (std::size_t i = 0; i < _opt.count / 10; ++i)
+			{
+				dlog(stream, "Thread", t, "message", i);
+			}
+
+			ready.fetch_add(1);
+			while (!go.load())
+			{
+				std::this_thread::yield();
+			}
+
+			for (std::size_t i = 0; i < _opt.count; ++i)
+			{
+				const Clock::time_point begin(Clock::now());
+				dlog(stream, "Thread", t, "message", i);
+				lat[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count();
+			}
+		});
+	}
+
+	while (ready.load() < _threads)
+	{
+		std::this_thread::yield();
+	}
+
+	dlog::drain();
+	const dlog::Stats before(dlog::stats());
+	const Clock::time_point start(Clock::now());
+	go.store(true);
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	dlog::drain();
+	const double elapsed(std::chrono::duration<double>(Clock::now() - start).count());
+	const dlog::Stats after(dlog::stats());
+
+	std::vector<std::int64_t> all;
+	all.reserve(_threads * _opt.count);
+	for (const auto& lat : latency)
+	{
+		all.insert(all.end(), lat.begin(), lat.end());
+	}
+	std::sort(all.begin(), all.end());
+
+	Scaling s;
+	s.streams = _shared ? "shared" : "separate";
+	s.threads = _threads;
+	s.count = all.size();
+	s.throughput = static_cast<double>(all.size()) / elapsed;
+	s.p50 = percentile(all, 0.5);
+	s.p99 = percentile(all, 0.99);
+	s.p999 = percentile(all, 0.999);
+	s.max = all.back();
+	s.lock_wait = after.lock_wait - before.lock_wait;
+	s.write_time = after.write_time - before.write_time;
+	return s;
+}
+
+/// Sweep the thread count in sync and async mode.
+void scale(const Options& _opt, std::vector<Scaling>& _results)
+{
+	std::vector<uint> counts;
+	for (uint t = 1; t < _opt.threads; t *= 2)
+	{
+		counts.push_back(t);
+	}
+	counts.push_back(_opt.threads);
+
+	for (const bool async : {false, true})
+	{
+		dlog::set_async(async);
+		for (const bool shared : {true, false})
+		{
+			for (const uint threads : counts)
+			{
+				Scaling s(scale(_opt, threads, shared));
+				s.mode = async ? "async" : "sync";
+				_results.push_back(std::move(s));
+			}
+		}
+	}
+	dlog::set_async(false);
+}
+
+///=============================================================================
+///	Output
+///=============================================================================
+
+void print(const Options& _opt, const std::vector<Summary>& _results, const std::vector<Scaling>& _scaling)
+{
+	std::cout << "{\n"
+			  << "  \"version\": \"" << dlog::version << "\",\n"
+			  << "  \"count\": " << _opt.count << ",\n"
+			  << "  \"rate\": " << _opt.rate << ",\n"
+			  << "  \"unit\": \"ns\",\n"
+			  << "  \"latency\": [\n";
+
+	for (std::size_t i = 0; i < _results.size(); ++i)
+	{
+		const Summary& s(_results[i]);
+		std::cout << "    {\"sink\": \"" << s.sink << "\""
+				  << ", \"args\": \"" << s.args << "\""
+				  << ", \"size\": " << s.size
+				  << ", \"count\": " << s.count
+				  << ", \"p50\": " << s.p50
+				  << ", \"p99\": " << s.p99
+				  << ", \"p99.9\": " << s.p999
+				  << ", \"max\": " << s.max
+				  << ", \"service_p50\": " << s.service_p50
+				  << ", \"service_max\": " << s.service_max
+				  << "}" << (i + 1 < _results.size() ? "," : "") << "\n";
+	}
+
+	std::cout << "  ],\n"
+			  << "  \"scaling\": [\n";
+
+	for (std::size_t i = 0; i < _scaling.size(); ++i)
+	{
+		const Scaling& s(_scaling[i]);
+		std::cout << "    {\"mode\": \"" << s.mode << "\""
+				  << ", \"streams\": \"" << s.streams << "\""
+				  << ", \"threads\": " << s.threads
+				  << ", \"count\": " << s.count
+				  << ", \"throughput\": " << static_cast<std::int64_t>(s.throughput)
+				  << ", \"p50\": " << s.p50
+				  << ", \"p99\": " << s.p99
+				  << ", \"p99.9\": " << s.p999
+				  << ", \"max\": " << s.max
+				  << ", \"lock_wait\": " << s.lock_wait
+				  << ", \"write_time\": " << s.write_time
+				  << "}" << (i + 1 < _scaling.size() ? "," : "") << "\n";
+	}
+
+	std::cout << "  ]\n"
+			  << "}\n";
+}
+
+///=============================================================================
+///	Main event
+///=============================================================================
+
+int main(int argc, char* argv[])
+{
+	Options opt;
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg(argv[i]);
+		if (i + 1 == argc)
+		{
+			std::cerr << "Missing value for " << arg << "\n";
+			return 1;
+		}
+		if (arg == "--suite")
+		{
+			opt.suite = argv[++i];
+		}
+		else if (arg == "--count")
+		{
+			opt.count = std::stoul(argv[++i]);
+		}
+		else if (arg == "--rate")
+		{
+			opt.rate = std::stod(argv[++i]);
+		}
+		else if (arg == "--threads")
+		{
+			opt.threads = static_cast<uint>(std::stoul(argv[++i]));
+		}
+		else if (arg == "--dir")
+		{
+			opt.dir = argv[++i];
+		}
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--suite latency|scaling|all] [--count N] [--rate R] [--threads T] [--dir D]\n";
+			return 1;
+		}
+	}
+
+	if (opt.count == 0 || opt.rate <= 0 || opt.threads == 0)
+	{
+		std::cerr << "The count, the rate and the number of threads must be positive\n";
+		return 1;
+	}
+
+	if (opt.suite != "latency" && opt.suite != "scaling" && opt.suite != "all")
+	{
+		std::cerr << "Unknown suite " << opt.suite << "\n";
+		return 1;
+	}
+
+	std::vector<Summary> results;
+	std::vector<Scaling> scaling;
+
+	if (opt.suite != "scaling")
+	{
+		{
+			NullBuffer buf;
+			std::ostream null(&buf);
+			run(opt, "null", null, results);
+		}
+
+		{
+			std::ofstream devnull("/dev/null");
+			run(opt, "/dev/null", devnull, results);
+		}
+
+		{
+			std::ofstream file(opt.dir + "/dlog_bench.log", std::ios::out | std::ios::trunc);
+			run(opt, "file", file, results);
+		}
+
+		{
+			std::ofstream file(opt.dir + "/dlog_bench_async.log", std::ios::out | std::ios::trunc);
+			dlog::set_async(true);
+			run(opt, "async file", file, results);
+			dlog::set_async(false);
+		}
+	}
+
+	if (opt.suite != "latency")
+	{
+		scale(opt, scaling);
+	}
+
+	print(opt, results, scaling);
+
+	return 0;
+}
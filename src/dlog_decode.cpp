@@ -0,0 +1,67 @@
+#include <iostream>
+#include <fstream>
+#include "dlog.hpp"
+
+///=============================================================================
+///	Turns binary logs written through Async::BinaryFile into text.
+///	Given a file written through Async::MappedFile, it recovers
+///	the committed content instead (for example after a crash).
+///
+///	Usage: dlog_decode <binary log> [output file]
+///
+///	The output goes to std::cout unless an output file is given.
+///=============================================================================
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2 || argc > 3)
+	{
+		std::cerr << "Usage: " << argv[0] << " <binary log> [output file]\n";
+		return 1;
+	}
+
+	std::ifstream in(argv[1], std::ios::in | std::ios::binary);
+	if (!in)
+	{
+		std::cerr << "Cannot open " << argv[1] << "\n";
+		return 1;
+	}
+
+	std::ofstream file;
+	if (argc == 3)
+	{
+		file.open(argv[2], std::ios::out | std::ios::trunc);
+		if (!file)
+		{
+			std::cerr << "Cannot open " << argv[2] << "\n";
+			return 1;
+		}
+	}
+	std::ostream& out(argc == 3 ? file : std::cout);
+
+#ifdef DLOG_HAS_MMAP
+	std::string magic(Async::MappedFile::magic.size(), '\0');
+	in.read(magic.data(), static_cast<std::streamsize>(magic.size()));
+	in.clear();
+	in.seekg(0);
+	if (magic == Async::MappedFile::magic)
+	{
+		if (!Async::MappedFile::recover(in, out))
+		{
+			out.flush();
+			std::cerr << argv[1] << " is truncated\n";
+			return 2;
+		}
+		return 0;
+	}
+#endif
+
+	if (!Async::BinaryFile::decode(in, out))
+	{
+		out.flush();
+		std::cerr << argv[1] << " is not a binary log or is truncated\n";
+		return 2;
+	}
+
+	return 0;
+}
@@ -12,10 +12,7 @@
 
 std::string time()
 {
-	std::stringstream tm;
-	std::time_t cur_time(std::time(nullptr));
-	tm << std::put_time(std::localtime(&cur_time), "%c %Z");
-	return tm.str();
+	return std::string(Async::Timestamp::now());
 }
 
 ///=============================================================================
@@ -42,24 +39,29 @@ enum class LogLevel : uint
 	Critical
 };
 
+/// Prefix shared by all levels. The level and the time
+/// are filled in when the message is written.
+static const auto layout(std::make_shared<Layout>("(%l) [%L][%T] ",
+												  std::vector<std::string>{"Log     ", "Info    ", "Warn    ", "Error   ", "Critical"}));
+
 AffixSet afx(const LogLevel _level)
 {
 	switch (_level)
 	{
 	case LogLevel::Log:
-		return {0, "(0) [Log     ][" + time() + "] ", " - "};
+		return {0, "", " - ", AffixSet::Default::suffix, layout};
 
 	case LogLevel::Info:
-		return {1, "(1) [Info    ][" + time() + "] ", " / "};
+		return {1, "", " / ", AffixSet::Default::suffix, layout};
 
 	case LogLevel::Warn:
-		return {2, "(2) [Warn    ][" + time() + "] ", " | "};
+		return {2, "", " | ", AffixSet::Default::suffix, layout};
 
 	case LogLevel::Error:
-		return {3, "(3) [Error   ][" + time() + "] ", " \\ "};
+		return {3, "", " \\ ", AffixSet::Default::suffix, layout};
 
 	case LogLevel::Critical:
-		return {4, "(4) [Critical][" + time() + "] ", " - "};
+		return {4, "", " - ", AffixSet::Default::suffix, layout};
 
 	default:
 		return AffixSet();
@@ -95,18 +97,18 @@ template<LogLevel level = LogLevel::Log>
 uint uint_void()
 {
 	uint sleep(sleep_dist(rng));
-	dlog("\tuint_void sleeping for", sleep, "ms");
+	DLOG(level, "\tuint_void sleeping for", sleep, "ms");
 	std::this_thread::sleep_for(std::chrono::milliseconds(sleep));
-	dlog("\tuint_void slept for", sleep, "ms");
+	DLOG(level, "\tuint_void slept for", sleep, "ms");
 	return sleep;
 }
 
 template<LogLevel level = LogLevel::Log>
 void void_uint(const uint _val)
 {
-	dlog("\tvoid_uint sleeping for", _val, "ms");
+	DLOG(level, "\tvoid_uint sleeping for", _val, "ms");
 	std::this_thread::sleep_for(std::chrono::milliseconds(_val));
-	dlog("\tvoid_uint slept for", _val, "ms");
+	DLOG(level, "\tvoid_uint slept for", _val, "ms");
 }
 
 void act()
@@ -173,6 +175,10 @@ int main()
 	std::shared_ptr<std::ofstream> log_file(std::make_shared<std::ofstream>(log_file_name, std::ios::out | (log_file_exists ? std::ios::app : std::ios::trunc)));
 	log_file_exists = true;
 
+	// Console and log file together. Messages
+	// logged to both are formatted only once.
+	std::shared_ptr<Tee> both(std::make_shared<Tee>(std::cout, log_file));
+
 	uint worker(0);
 
 	// Output a header to the log file
@@ -194,10 +200,27 @@ int main()
 				std::this_thread::sleep_for(std::chrono::milliseconds(sleep_dist(rng)));
 
 				/// Output to std::cout.
-				dlog(afx(rnd_level()), "\tMessage from worker", w, "in thread", std::this_thread::get_id());
+				/// The affixes (including the time) are
+				/// only computed if the message is printed.
+				LogLevel level(rnd_level());
+				if (dlog::active(level))
+				{
+					dlog(afx(level), "\tMessage from worker", w, "in thread", std::this_thread::get_id());
+				}
 
 				// Output to a file.
-				dlog(log_file, afx(rnd_level()), "\tMessage from worker", w, "in thread", std::this_thread::get_id());
+				level = rnd_level();
+				if (dlog::active(level))
+				{
+					dlog(log_file, afx(level), "\tMessage from worker", w, "in thread", std::this_thread::get_id());
+				}
+
+				// Output to std::cout and the file.
+				level = rnd_level();
+				if (dlog::active(level))
+				{
+					dlog(both, afx(level), "\tMessage from worker", w, "to console and file");
+				}
 			}
 		});
 	}